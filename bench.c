@@ -0,0 +1,489 @@
+/* bench.c
+ *
+ * benchmarks of the filesystem API
+ *
+ * Every benchmark times a number of samples, each sample covering a fixed
+ * number of operations, and writes one line of JSON to the result file:
+ *
+ * {"name":..., "ops":..., "seconds":..., "ops_per_sec":...,
+ *  "p50_ns":..., "p90_ns":..., "p99_ns":..., "max_ns":...}
+ *
+ * Latencies are per operation, sequential benchmarks count bytes as
+ * operations.
+ *
+ * usage: bench.exe [result file, bench_output.txt by default]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "filesys.h"
+
+#define BENCHBLOCKCOUNT  65536                  // 64 MiB volume for throughput benchmarks
+#define BENCHBLOCKSIZE   1024
+#define BENCHFATWIDTH    32
+#define STREAMBYTES      (16 * 1024 * 1024)     // bytes written and read by sequential benchmarks
+#define CHUNKBYTES       (64 * 1024)            // bytes per sample of sequential benchmarks
+#define CHURNFILES       2000
+#define PATHDEPTH        16
+#define LOOKUPS          20000
+#define LISTENTRIES      1000
+#define LISTINGS         200
+#define FULLFREEBLOCKS   256                    // free blocks left when allocating on a nearly full FAT
+#define SAVELOADS        10
+#define REMOVES          20
+#define IMAGEFILE        "bench_disk.img"
+#define DELTAFILE        "bench_disk.delta"
+#define HOSTDIR          "bench_host"
+#define HOSTFILES        32
+#define HOSTFILEBYTES    (256 * 1024)
+#define IMPORTS          5
+
+FILE * results;
+
+
+double now()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int compareDoubles(const void * a, const void * b)
+{
+   double x = *(const double *)a, y = *(const double *)b;
+   return (x > y) - (x < y);
+}
+
+//samples holds seconds taken by each of count samples of opsPerSample operations
+void report(const char * name, double * samples, int count, long opsPerSample)
+{
+   double seconds = 0;
+   for (int i = 0; i < count; i++)
+      seconds += samples[i];
+
+   qsort(samples, count, sizeof(double), compareDoubles);
+   double perOp = 1e9 / opsPerSample;
+   long ops = opsPerSample * count;
+
+   fprintf(results, "{\"name\":\"%s\",\"ops\":%ld,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+                    "\"p50_ns\":%.1f,\"p90_ns\":%.1f,\"p99_ns\":%.1f,\"max_ns\":%.1f}\n",
+           name, ops, seconds, ops / seconds,
+           samples[count / 2] * perOp, samples[count * 9 / 10] * perOp,
+           samples[count * 99 / 100] * perOp, samples[count - 1] * perOp);
+   fflush(results);
+}
+
+fs_t * freshVolume(int blockCount)
+{
+   fs_t * fs = fs_create();
+   geometry_t geometry = { blockCount, BENCHBLOCKSIZE, BENCHFATWIDTH, DEFAULTJOURNALBLOCKS };
+   if ((fs == NULL) || (format(fs, &geometry) != 0)) {
+      fprintf(stderr, "cannot format benchmark volume\n");
+      exit(1);
+   }
+   return fs;
+}
+
+
+/* sequential throughput through myfputc/myfgetc and myfwrite/myfread */
+
+void benchSequential()
+{
+   fs_t * fs = freshVolume(BENCHBLOCKCOUNT);
+   int count = STREAMBYTES / CHUNKBYTES;
+   double * samples = malloc(count * sizeof(double));
+   Byte * chunk = malloc(CHUNKBYTES);
+   memset(chunk, 0x5a, CHUNKBYTES);
+
+   MyFILE * file = myfopen(fs, "putc", 'w');
+   for (int i = 0; i < count; i++) {
+      double start = now();
+      for (int j = 0; j < CHUNKBYTES; j++)
+         myfputc((Byte)j, file);
+      samples[i] = now() - start;
+   }
+   myfclose(file);
+   report("seq_write_putc", samples, count, CHUNKBYTES);
+
+   file = myfopen(fs, "putc", 'r');
+   int sum = 0;
+   for (int i = 0; i < count; i++) {
+      double start = now();
+      for (int j = 0; j < CHUNKBYTES; j++)
+         sum += myfgetc(file);
+      samples[i] = now() - start;
+   }
+   myfclose(file);
+   report("seq_read_getc", samples, count, CHUNKBYTES);
+
+   file = myfopen(fs, "fwrite", 'w');
+   for (int i = 0; i < count; i++) {
+      double start = now();
+      myfwrite(chunk, CHUNKBYTES, file);
+      samples[i] = now() - start;
+   }
+   myfclose(file);
+   report("seq_write_fwrite", samples, count, CHUNKBYTES);
+
+   file = myfopen(fs, "fwrite", 'r');
+   for (int i = 0; i < count; i++) {
+      double start = now();
+      sum += myfread(chunk, CHUNKBYTES, file);
+      samples[i] = now() - start;
+   }
+   myfclose(file);
+   report("seq_read_fread", samples, count, CHUNKBYTES);
+
+   if (sum == 0)
+      fprintf(stderr, "nothing read\n");
+   free(chunk);
+   free(samples);
+   fs_destroy(fs);
+}
+
+
+/* creating, writing a byte to, closing and removing files in one directory */
+
+void benchChurn()
+{
+   fs_t * fs = freshVolume(BENCHBLOCKCOUNT);
+   double * samples = malloc(CHURNFILES * sizeof(double));
+   char name[32];
+
+   mymkdir(fs, "/churn");
+   //half of the files stay, so the directory is not empty
+   for (int i = 0; i < CHURNFILES; i += 2) {
+      sprintf(name, "/churn/keep%d", i);
+      myfclose(myfopen(fs, name, 'w'));
+   }
+
+   for (int i = 0; i < CHURNFILES; i++) {
+      sprintf(name, "/churn/file%d", i);
+      double start = now();
+      MyFILE * file = myfopen(fs, name, 'w');
+      myfputc('x', file);
+      myfclose(file);
+      myremove(fs, name);
+      samples[i] = now() - start;
+   }
+   report("create_delete", samples, CHURNFILES, 1);
+
+   free(samples);
+   fs_destroy(fs);
+}
+
+
+/* removing a large file and rewriting a file in place */
+
+void benchRemoveLarge()
+{
+   fs_t * fs = freshVolume(BENCHBLOCKCOUNT);
+   double * samples = malloc(REMOVES * sizeof(double));
+   Byte * chunk = malloc(CHUNKBYTES);
+   memset(chunk, 0x7e, CHUNKBYTES);
+
+   for (int i = 0; i < REMOVES; i++) {
+      MyFILE * file = myfopen(fs, "large", 'w');
+      for (int j = 0; j < STREAMBYTES / CHUNKBYTES; j++)
+         myfwrite(chunk, CHUNKBYTES, file);
+      myfclose(file);
+
+      double start = now();
+      myremove(fs, "large");
+      samples[i] = now() - start;
+   }
+   report("remove_large", samples, REMOVES, 1);
+
+   //rewriting the same file over and over
+   samples = realloc(samples, CHURNFILES * sizeof(double));
+   for (int i = 0; i < CHURNFILES; i++) {
+      double start = now();
+      MyFILE * file = myfopen(fs, "rewritten", 'w');
+      myfwrite(chunk, CHUNKBYTES, file);
+      myfclose(file);
+      samples[i] = now() - start;
+   }
+   report("rewrite_64k", samples, CHURNFILES, 1);
+
+   free(chunk);
+   free(samples);
+   fs_destroy(fs);
+}
+
+
+/* opening a file at the end of a deep path */
+
+void benchDeepPath()
+{
+   fs_t * fs = freshVolume(BENCHBLOCKCOUNT);
+   double * samples = malloc(LOOKUPS * sizeof(double));
+   char path[PATHDEPTH * 8 + 16] = "";
+
+   for (int i = 0; i < PATHDEPTH; i++) {
+      sprintf(path + strlen(path), "/dir%02d", i);
+      mymkdir(fs, path);
+      //siblings make every level a directory worth searching
+      for (int j = 0; j < 16; j++) {
+         char sibling[sizeof(path) + 8];
+         sprintf(sibling, "%s_%d", path, j);
+         mymkdir(fs, sibling);
+      }
+   }
+   strcat(path, "/leaf");
+   myfclose(myfopen(fs, path, 'w'));
+
+   for (int i = 0; i < LOOKUPS; i++) {
+      double start = now();
+      myfclose(myfopen(fs, path, 'r'));
+      samples[i] = now() - start;
+   }
+   report("deep_path_open", samples, LOOKUPS, 1);
+
+   free(samples);
+   fs_destroy(fs);
+}
+
+
+/* listing a directory with many entries, through mylistdir and myreaddir */
+
+void benchListDir()
+{
+   fs_t * fs = freshVolume(BENCHBLOCKCOUNT);
+   double * samples = malloc(LISTINGS * sizeof(double));
+   char name[32];
+
+   mymkdir(fs, "/full");
+   for (int i = 0; i < LISTENTRIES; i++) {
+      sprintf(name, "/full/entry%d", i);
+      myfclose(myfopen(fs, name, 'w'));
+   }
+
+   for (int i = 0; i < LISTINGS; i++) {
+      double start = now();
+      freeList(mylistdir(fs, "/full"));
+      samples[i] = now() - start;
+   }
+   report("listdir_full", samples, LISTINGS, 1);
+
+   long length = 0;
+   for (int i = 0; i < LISTINGS; i++) {
+      double start = now();
+      MyDIR * dir = myopendir(fs, "/full");
+      const dirEntry_t * entry;
+      while ((entry = myreaddir(dir)) != NULL)
+         length += entry->fileLength;
+      myclosedir(dir);
+      samples[i] = now() - start;
+   }
+   report("readdir_full", samples, LISTINGS, 1);
+   if (length != 0)
+      fprintf(stderr, "unexpected file length\n");
+
+   free(samples);
+   fs_destroy(fs);
+}
+
+
+/* growing a file by a block at a time when the FAT is nearly full */
+
+void benchNearlyFull()
+{
+   int blockCount = 32768;
+   fs_t * fs = freshVolume(blockCount);
+   Byte * block = malloc(BENCHBLOCKSIZE);
+   memset(block, 0x11, BENCHBLOCKSIZE);
+
+   //fill the volume with files of scattered sizes, leaving FULLFREEBLOCKS
+   //blocks free, spread over the disk by removing every other file
+   char name[32];
+   int files = 0;
+   MyFILE * file;
+   for (;;) {
+      sprintf(name, "fill%d", files);
+      file = myfopen(fs, name, 'w');
+      if (file == NULL)
+         break;
+      size_t blocks = 1 + files % 7, written = 0;
+      for (size_t i = 0; i < blocks; i++)
+         written += myfwrite(block, BENCHBLOCKSIZE, file);
+      myfclose(file);
+      files++;
+      if (written < blocks * BENCHBLOCKSIZE)
+         break;
+   }
+   int freed = 0;
+   for (int i = 0; (i < files) && (freed < FULLFREEBLOCKS); i += 2) {
+      sprintf(name, "fill%d", i);
+      myremove(fs, name);
+      freed += 1 + i % 7;
+   }
+
+   int count = freed - 1;
+   if (count < 1) {
+      free(block);
+      fs_destroy(fs);
+      return;
+   }
+   double * samples = malloc(count * sizeof(double));
+   file = myfopen(fs, "/grow", 'w');
+   int taken = 0;
+   for (; taken < count; taken++) {
+      double start = now();
+      size_t written = myfwrite(block, BENCHBLOCKSIZE, file);
+      samples[taken] = now() - start;
+      if (written < BENCHBLOCKSIZE)
+         break;
+   }
+   myfclose(file);
+   if (taken > 0)
+      report("alloc_nearly_full", samples, taken, 1);
+
+   free(samples);
+   free(block);
+   fs_destroy(fs);
+}
+
+
+/* saving the volume to and loading it from an image file */
+
+void benchSaveLoad()
+{
+   fs_t * fs = freshVolume(BENCHBLOCKCOUNT);
+   double * samples = malloc(SAVELOADS * sizeof(double));
+
+   MyFILE * file = myfopen(fs, "content", 'w');
+   Byte chunk[CHUNKBYTES];
+   memset(chunk, 0x3c, CHUNKBYTES);
+   for (int i = 0; i < 256; i++)
+      myfwrite(chunk, CHUNKBYTES, file);
+   myfclose(file);
+
+   for (int i = 0; i < SAVELOADS; i++) {
+      double start = now();
+      writeDisk(fs, IMAGEFILE);
+      samples[i] = now() - start;
+   }
+   report("write_disk", samples, SAVELOADS, 1);
+
+   //checkpoints after rewriting one chunk of the content
+   for (int i = 0; i < SAVELOADS; i++) {
+      file = myfopen(fs, "content", 'a');
+      myfseek(file, (long)i * CHUNKBYTES, SEEK_SET);
+      myfwrite(chunk, CHUNKBYTES, file);
+      myfclose(file);
+      double start = now();
+      writeDiskIncremental(fs, DELTAFILE);
+      samples[i] = now() - start;
+   }
+   report("write_disk_incremental", samples, SAVELOADS, 1);
+
+   for (int i = 0; i < SAVELOADS; i++) {
+      double start = now();
+      readDisk(fs, IMAGEFILE);
+      samples[i] = now() - start;
+   }
+   report("read_disk", samples, SAVELOADS, 1);
+
+   //content of a freshly read image, block by block and with every block in flight
+   long contentBytes = 256L * CHUNKBYTES;
+   Byte * content = malloc(contentBytes);
+   for (int bulk = 0; bulk <= 1; bulk++) {
+      if (bulk)
+         fs_io_start(fs, 0);
+      for (int i = 0; i < SAVELOADS; i++) {
+         readDisk(fs, IMAGEFILE);
+         double start = now();
+         file = myfopen(fs, "content", 'r');
+         if (bulk)
+            myfreadbulk(content, contentBytes, file);
+         else
+            myfread(content, contentBytes, file);
+         myfclose(file);
+         samples[i] = now() - start;
+      }
+      report(bulk ? "read_image_bulk" : "read_image", samples, SAVELOADS, contentBytes);
+   }
+   fs_io_stop(fs);
+   free(content);
+
+   unlink(IMAGEFILE);
+   unlink(DELTAFILE);
+   free(samples);
+   fs_destroy(fs);
+}
+
+
+/* copying host files into the volume one at a time and as a batch */
+
+void benchImport()
+{
+   double * samples = malloc(IMPORTS * sizeof(double));
+   char * hostPaths[HOSTFILES];
+   char * paths[HOSTFILES];
+   Byte * chunk = malloc(HOSTFILEBYTES);
+   memset(chunk, 0x5a, HOSTFILEBYTES);
+
+   mkdir(HOSTDIR, 0755);
+   for (int i = 0; i < HOSTFILES; i++) {
+      hostPaths[i] = malloc(64);
+      paths[i] = malloc(64);
+      sprintf(hostPaths[i], HOSTDIR "/file%d", i);
+      sprintf(paths[i], "/file%d", i);
+      FILE * host = fopen(hostPaths[i], "w");
+      fwrite(chunk, 1, HOSTFILEBYTES, host);
+      fclose(host);
+   }
+
+   for (int batch = 0; batch <= 1; batch++) {
+      for (int i = 0; i < IMPORTS; i++) {
+         fs_t * fs = freshVolume(BENCHBLOCKCOUNT);
+         double start = now();
+         if (batch)
+            copyRealFilesToMyDisk(fs, hostPaths, paths, HOSTFILES, 0, NULL);
+         else
+            for (int j = 0; j < HOSTFILES; j++)
+               copyRealFileToMyDisk(fs, hostPaths[j], paths[j]);
+         samples[i] = now() - start;
+         fs_destroy(fs);
+      }
+      report(batch ? "import_batch" : "import", samples, IMPORTS, (long)HOSTFILES * HOSTFILEBYTES);
+   }
+
+   for (int i = 0; i < HOSTFILES; i++) {
+      unlink(hostPaths[i]);
+      free(hostPaths[i]);
+      free(paths[i]);
+   }
+   rmdir(HOSTDIR);
+   free(chunk);
+   free(samples);
+}
+
+
+int main(int argc, char ** argv)
+{
+   const char * resultFile = (argc > 1) ? argv[1] : "bench_output.txt";
+   results = fopen(resultFile, "w");
+   if (results == NULL) {
+      fprintf(stderr, "cannot open %s\n", resultFile);
+      return 1;
+   }
+
+   benchSequential();
+   benchChurn();
+   benchRemoveLarge();
+   benchDeepPath();
+   benchListDir();
+   benchNearlyFull();
+   benchSaveLoad();
+   benchImport();
+
+   fclose(results);
+   return 0;
+}
@@ -0,0 +1,4 @@
+rm bench.exe
+gcc -std=c99 -O2 bench.c filesys.c -o bench.exe -pthread
+./bench.exe bench_output.txt
+cat bench_output.txt
\ No newline at end of file
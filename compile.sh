@@ -1,4 +1,4 @@
 rm program.exe
-gcc -std=c99 shell.c filesys.c -o program.exe
+gcc -std=c99 shell.c filesys.c -o program.exe -pthread
 ./program.exe
 xxd virtualdiskA5_A1 dump.txt
\ No newline at end of file
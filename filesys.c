@@ -1,562 +1,3954 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE          // madvise, see block cache
+
 #include <stdio.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "filesys.h"
 
 
-diskBlock_t  virtualDisk [MAXBLOCKS];           // define our in-memory virtual, with MAXBLOCKS blocks
-fatEntry_t   FAT         [MAXBLOCKS];           // define a file allocation table with MAXBLOCKS 16-bit entries
-fatEntry_t   rootDirIndex            = 0 ;       // rootDir will be set by format
-dirEntry_t   staticBufferForCurrentDir;
-dirEntry_t * currentDir              = &staticBufferForCurrentDir;
-fatEntry_t   currentDirIndex         = 0 ;
+#define LAZYGROUPBLOCKS 64                                                 // blocks readDisk loads at a time
 
+//Statistics of fs, see fs_get_stats. Without FS_STATS they compile to nothing.
+#ifdef FS_STATS
+#define COUNT(fs, counter, n)        __atomic_fetch_add(&(fs)->stats.counter, (uint64_t)(n), __ATOMIC_RELAXED)
+#define STARTTIMER(timer)            uint64_t timer = nanoseconds()
+#define STOPTIMER(fs, counter, timer) COUNT(fs, counter, nanoseconds() - (timer))
+#else
+#define COUNT(fs, counter, n)        ((void)(fs), (void)sizeof(n))          // n is not evaluated
+#define STARTTIMER(timer)            ((void)0)
+#define STOPTIMER(fs, counter, timer) ((void)(fs))
+#endif
 
-void readFAT();
-void setCurrentDirToRoot();
-folderAndEntry getDetailsFromPath(const char * path);
-int getParentBlock(int indexOfDirectory);
 
-/* writeDisk : writes virtual disk out to physical disk
- * 
- * in: file name of stored virtual disk
- */
+//Threads working off block requests of a context, see fs_io_start
+typedef struct ioEngine {
+   pthread_mutex_t   lock ;
+   pthread_cond_t    submitted ;          // signalled when requests are queued or the engine stops
+   pthread_cond_t    completed ;          // signalled when a request left to fs_io_poll completes
+   fs_io_request_t * queueFirst ;         // requests waiting for a thread, oldest first
+   fs_io_request_t * queueLast ;
+   fs_io_request_t * doneFirst ;          // completed requests fs_io_poll has not returned yet
+   fs_io_request_t * doneLast ;
+   int               inFlight ;           // submitted and not completed yet
+   int               stopping ;
+   int               threadCount ;
+   pthread_t       * threads ;
+} ioEngine_t ;
 
-void writeDisk ( const char * filename )
-{
-   FILE * dest = fopen( filename, "w" ) ;
-   if ( fwrite ( virtualDisk, sizeof(virtualDisk), 1, dest ) < 0 )
-      fprintf ( stderr, "write virtual disk to disk failed\n" ) ;
-   //write( dest, virtualDisk, sizeof(virtualDisk) ) ;
-   fclose(dest);
-   printf("\nDisk has been saved.");
+
+struct fs {
+   geometry_t   volume ;
+   Byte       * memoryDisk ;              // in-memory virtual disk, allocated by format and readDisk
+   Byte       * virtualDisk ;             // blocks in use: memoryDisk or a mapped disk image
+   size_t       diskSize ;                // bytes available at virtualDisk
+   int          diskIsMapped ;            // set while virtualDisk points at a mapping made by mapDisk
+   int          diskFd ;                  // image file mapped by mapDisk
+   int          imageFd ;                 // image file read by readDisk while some of it is not loaded, -1 if none
+   uint64_t   * loadedGroups ;            // bit set for every group of LAZYGROUPBLOCKS blocks loaded from imageFd
+   uint64_t   * loadingGroups ;           // bit set while a thread loads the group
+   uint64_t   * unsyncedBlocks ;          // bit set for every block written since last msync of the mapping
+   uint64_t   * metadataBlocks ;          // bit set for superblock, FAT and directory blocks written since last commit
+   uint64_t   * changedBlocks ;           // bit set for every block written since last checkpoint, see writeDiskIncremental
+   uint32_t     checkpointSequence ;      // deltas written since last full checkpoint
+   MyFILE     * writers ;                 // open handles which may write, see holdWriters
+   fatEntry_t * FAT ;                     // file allocation table with an entry per block
+   fatEntry_t   rootDirIndex ;            // rootDir will be set by format
+   dirEntry_t   staticBufferForCurrentDir ;
+   dirEntry_t * currentDir ;              // NULL for root
+   fatEntry_t   currentDirIndex ;
+   uint64_t   * freeBitmap ;              // bit set for every block marked UNUSED in FAT
+   uint64_t   * unscrubbedBlocks ;        // bit set for blocks freed but not zeroed yet, see scrubBlocks
+   uint64_t   * heldBlocks ;              // bit set for blocks freed but held until their free is committed, see holdFrees
+   uint64_t   * keptBlocks ;              // bit set for blocks kept for a handle, free in the FAT on disk, see keepBlock
+   int          keptBlockCount ;          // bits set in keptBlocks
+   uint64_t   * dirBlocks ;               // bit set for blocks of directories, see directory blocks
+   int          dirBlocksKnown ;          // set once dirBlocks holds all directories of the volume
+   uint64_t   * freeAtCommit ;            // bit set for blocks free at last commit of a journaled image
+   int          heldBlockCount ;          // bits set in heldBlocks
+   int          zeroing ;                 // what happens to freed blocks, see fs_set_zeroing
+   int          nextFitCursor ;           // block at which the next free block search starts
+   int          freeBlockCount ;          // bits set in freeBitmap
+   Byte       * fatBlockDirty ;           // set when FAT entries stored in that FAT block changed since last copyFAT
+   dirIndex_t   dirIndexes [DIRINDEXSLOTS];        // name indexes of recently searched directories
+   dentry_t     dentryCache [DENTRYCACHESIZE];     // recently resolved path components
+   int          dentryBuckets [DENTRYCACHESIZE];   // first slot of each hash chain of dentryCache, -1 if none
+   int          lruFirst ;                // most recently used slot of dentryCache
+   int          lruLast ;                 // least recently used slot of dentryCache
+   int          readaheadBlocks ;         // readahead window of handles, see readAhead
+   int          cacheBlocks ;             // blocks of a mapped image handles keep resident, see fs_set_cache
+   int          cacheLineBlocks ;         // blocks in a line of the cache, see block cache
+   int          cacheCapacity ;           // lines cacheRing holds, 0 while the cache is off
+   int        * cacheRing ;               // lines in the cache, in the order the hand passes them
+   int          cacheUsed ;               // slots of cacheRing in use
+   int          cacheHand ;               // slot looked at first for the next eviction
+   uint64_t   * cachedLines ;             // bit set for every line in cacheRing
+   uint64_t   * referencedLines ;         // bit set for lines used since the hand last passed them
+   fs_log_t     log ;                     // receives messages, NULL keeps the context silent
+   ioEngine_t * io ;                      // NULL unless fs_io_start was called
+   void       * logContext ;
    
+#ifdef FS_STATS
+   fs_stats_t   stats ;                   // updated atomically, see COUNT
+#endif
+   
+   pthread_rwlock_t volumeLock ;          // see lockVolume
+   pthread_mutex_t  fatLock ;             // FAT, free bitmap and nextFitCursor
+   pthread_mutex_t  dentryLock ;          // dentryCache and its lists
+   pthread_mutex_t  cwdLock ;             // current directory
+   pthread_mutex_t  loadLock ;            // loadedGroups and loadingGroups
+   pthread_mutex_t  writerLock ;          // writers
+   pthread_mutex_t  scanLock ;            // held by the thread which finds directory blocks, see knowDirBlocks
+   pthread_mutex_t  cacheLock ;           // cacheRing and cacheHand, see block cache
+   pthread_cond_t   groupLoaded ;         // signalled when a thread has loaded a group
+   pthread_mutex_t  dirLocks [DIRLOCKSHARDS];      // directories, by first block
+};
+
+//Geometry of the volume of fs, set by format and when a disk is read or mapped
+static inline int blockCount(const fs_t * fs)
+{
+   return fs->volume.blockCount;
 }
 
-void readDisk ( const char * filename )
+static inline int blockSize(const fs_t * fs)
 {
-   FILE * dest = fopen( filename, "r" ) ;
-   if ( fread ( virtualDisk, sizeof(virtualDisk), 1, dest ) < 0 )
-      fprintf ( stderr, "write virtual disk to disk failed\n" ) ;
-   //write( dest, virtualDisk, sizeof(virtualDisk) ) ;
-      fclose(dest) ;
-   
-   readFAT();
-   
-   rootDirIndex = 3;
-   currentDirIndex = 3;
-   currentDir = NULL;
+   return fs->volume.blockSize;
 }
 
+//FAT entries stored in one FAT block
+static inline int fatEntryCount(const fs_t * fs)
+{
+   return fs->volume.blockSize / (fs->volume.fatWidth / 8);
+}
 
-/* the basic interface to the virtual disk
- * this moves memory around
- */
+static inline int fatBlockCount(const fs_t * fs)
+{
+   return (fs->volume.blockCount + fatEntryCount(fs) - 1) / fatEntryCount(fs);
+}
+
+//Words of a bitmap with a bit per block
+static inline int bitmapWords(const fs_t * fs)
+{
+   return (fs->volume.blockCount + 63) / 64;
+}
 
-void writeBlock ( diskBlock_t * block, int block_address )
+//Words of a bitmap with a bit per group of LAZYGROUPBLOCKS blocks
+static inline int lazyGroupWords(const fs_t * fs)
 {
-   memmove(virtualDisk[block_address].data, block->data, BLOCKSIZE);
+   return ((fs->volume.blockCount + LAZYGROUPBLOCKS - 1) / LAZYGROUPBLOCKS + 63) / 64;
 }
 
+//Header block of the journal
+static inline int journalStart(const fs_t * fs)
+{
+   return 1 + fatBlockCount(fs);
+}
 
-/* read and write FAT
+//Targets which fit in the journal header
+static inline int journalCapacity(const fs_t * fs)
+{
+   return (fs->volume.blockSize - (int)offsetof(journalHeader_t, targets)) / 4;
+}
+
+
+void readFAT(fs_t * fs);
+void attachDisk(fs_t * fs);
+void copyFAT(fs_t * fs);
+int syncMappedDisk(fs_t * fs);
+int commitDisk(fs_t * fs);
+int replayJournal(fs_t * fs);
+int loadDisk(fs_t * fs, const char * filename);
+uint32_t newSnapshotId(fs_t * fs);
+void rebuildFreeBitmap(fs_t * fs);
+void dropAllDirIndexes(fs_t * fs);
+void dropAllDentries(fs_t * fs);
+void setCurrentDirToRoot(fs_t * fs);
+diskBlock_t * editBlock(fs_t * fs, int block_address);
+diskBlock_t * editMetaBlock(fs_t * fs, int block_address);
+diskBlock_t * blockRange(fs_t * fs, int first, int count);
+int loadGroupOf(fs_t * fs, int block_address);
+int loadAllBlocks(fs_t * fs);
+int releaseImage(fs_t * fs, const char * filename);
+void dropImage(fs_t * fs);
+void initDirBlock(fs_t * fs, int blockIndex, int parentBlockIndex);
+folderAndEntry getDetailsFromPath(fs_t * fs, const char * path);
+void findEntryOfDetails(fs_t * fs, folderAndEntry * details);
+int getParentBlock(fs_t * fs, int indexOfDirectory);
+int formatDisk(fs_t * fs, const geometry_t * geometry);
+int releaseMapping(fs_t * fs);
+int scrubBlocks(fs_t * fs, int maxBlocks);
+void releaseHeldBlocks(fs_t * fs);
+void borrowBlock(MyFILE * stream);
+void readAhead(MyFILE * stream);
+int bytesInLastBlock(fs_t * fs, int fileLength);
+void addWriter(MyFILE * stream);
+void dropWriter(MyFILE * stream);
+void holdWriters(fs_t * fs);
+void releaseWriters(fs_t * fs);
+void keepBlock(fs_t * fs, int index);
+void unkeepBlock(fs_t * fs, int index);
+int isBlockKept(fs_t * fs, int index);
+int isDirBlock(fs_t * fs, int index);
+void forgetDirBlock(fs_t * fs, int index);
+void forgetDirBlocks(fs_t * fs);
+int setupCache(fs_t * fs);
+void cacheBlock(fs_t * fs, int block);
+
+
+/* locking
  * 
- * please note: a FAT entry is a short, this is a 16-bit word, or 2 bytes
- *              our blocksize for the virtual disk is 1024, therefore
- *              we can store 512 FAT entries in one block
+ * The library can be used from many threads at once. Every call which uses
+ * the volume holds volumeLock shared; calls which replace or snapshot the
+ * whole volume (format, readDisk, writeDisk, mapDisk, unmapDisk), mysync,
+ * which commits a consistent volume to a mapped image, and myrmdir, which
+ * frees a directory other threads could be resolving paths through, hold it
+ * exclusive.
  * 
- *              how many disk blocks do we need to store the complete FAT:
- *              - our virtual disk has MAXBLOCKS blocks, which is currently 1024
- *                each block is 1024 bytes long
- *              - our FAT has MAXBLOCKS entries, which is currently 1024
- *                each FAT entry is a fatEntry_t, which is currently 2 bytes
- *              - we need (MAXBLOCKS /(BLOCKSIZE / sizeof(fatEntry_t))) blocks to store the
- *                FAT
- *              - each block can hold (BLOCKSIZE / sizeof(fatEntry_t)) fat entries
+ * Below that, fatLock covers FAT, the free bitmap and the allocator, and a
+ * directory's entries, name index and chain are covered by one of
+ * DIRLOCKSHARDS locks, chosen by first block of the directory. A directory
+ * lock may be held while taking fatLock or dentryLock, never the other way.
+ * loadLock and writerLock come last of all, loadLock is only held to claim
+ * or finish loading a group of blocks from an image read by readDisk, and
+ * writerLock to change or walk the list of writers. Bytes are written into
+ * a block borrowed by a handle under its own writeLock only, which syncs
+ * and checkpoints take for every writer, after writerLock, see holdWriters.
+ * The block cache takes them after fatLock and writerLock as well, and
+ * cacheLock last.
+ * 
+ * Blocks of a file are only touched through its handles, a handle must not
+ * be used by two threads at once and handles of one file share its blocks,
+ * but not its length or chain, which are not kept consistent between them.
+ * Current directory is shared by all threads using a context, under cwdLock.
+ * 
+ * All locks belong to a context, calls on different contexts never wait
+ * for each other.
  */
 
-/*****
-   FUNCTIONS FOR GCS D3-D1 BELOW
-*****/
+void lockVolume(fs_t * fs)
+{
+   pthread_rwlock_rdlock(&fs->volumeLock);
+}
+
+void lockVolumeExclusive(fs_t * fs)
+{
+   pthread_rwlock_wrlock(&fs->volumeLock);
+}
 
+void unlockVolume(fs_t * fs)
+{
+   pthread_rwlock_unlock(&fs->volumeLock);
+}
 
-void copyFAT()
+void lockFAT(fs_t * fs)
 {
-   writeBlock((diskBlock_t*)(fatBlock_t*)&FAT, 1);
-   writeBlock((diskBlock_t*)((uintptr_t)(diskBlock_t*)(fatBlock_t*)&FAT + sizeof(diskBlock_t)), 2);
+   pthread_mutex_lock(&fs->fatLock);
 }
 
+void unlockFAT(fs_t * fs)
+{
+   pthread_mutex_unlock(&fs->fatLock);
+}
 
-/* implement format()
+//Directories sharing a lock also share slots of dirIndexes,
+//as DIRLOCKSHARDS divides DIRINDEXSLOTS.
+void lockDir(fs_t * fs, int dirBlockIndex)
+{
+   pthread_mutex_lock(&fs->dirLocks[dirBlockIndex % DIRLOCKSHARDS]);
+}
+
+void unlockDir(fs_t * fs, int dirBlockIndex)
+{
+   pthread_mutex_unlock(&fs->dirLocks[dirBlockIndex % DIRLOCKSHARDS]);
+}
+
+
+/* file system context
+ * 
+ * A context holds one volume and everything kept in memory about it. It has
+ * no disk until format, readDisk or mapDisk is called on it. Any number of
+ * contexts can be used at once, each from any number of threads.
  */
-void format()
+
+//returns new context, or NULL if it cannot be allocated
+fs_t * fs_create()
 {
-   diskBlock_t block;
-   memset(&block, 0x0, BLOCKSIZE);
-      
-   for (int i = 0; i < MAXBLOCKS; i++)
-      writeBlock(&block, i);
-      
-	strcpy(block.data, "CS3026 Operating Systems Assignment");
-	writeBlock(&block, 0);
-	
-	/* prepare FAT table
-	 * write FAT blocks to virtual disk
-	 */
-	 
-	 for (int i = 0; i < MAXBLOCKS; i++)
-	   FAT[i] = UNUSED;
-	 
-	 FAT[0] = ENDOFCHAIN;
-	 FAT[1] = 2;
-	 FAT[2] = ENDOFCHAIN;
-	 FAT[3] = ENDOFCHAIN;  
-	
-	 copyFAT();
-	 
-	 
-	//Create, zero-out and prepare root directory
-   diskBlock_t newRootDir;
-   memset(&newRootDir, 0x0, BLOCKSIZE);
-   newRootDir.dir.isDir = 1;
-   newRootDir.dir.parentBlockIndex = 0;
-   newRootDir.dir.nextEntry = 0;
-   //Write it to the disk
-   writeBlock(&newRootDir, 3);
-   //Set the var having index of root dir block
-   rootDirIndex = 3;
+   fs_t * fs = calloc(1, sizeof(fs_t));
+   if (fs == NULL)
+      return NULL;
+   
+   fs->volume = (geometry_t){ DEFAULTBLOCKCOUNT, DEFAULTBLOCKSIZE, DEFAULTFATWIDTH, DEFAULTJOURNALBLOCKS };
+   fs->diskFd = -1;
+   fs->imageFd = -1;
+   fs->readaheadBlocks = DEFAULTREADAHEAD;
+   fs->cacheBlocks = DEFAULTCACHEBLOCKS;
+   fs->zeroing = FS_ZERO_DEFERRED;
    
-   setCurrentDirToRoot();
+   pthread_rwlock_init(&fs->volumeLock, NULL);
+   pthread_mutex_init(&fs->fatLock, NULL);
+   pthread_mutex_init(&fs->dentryLock, NULL);
+   pthread_mutex_init(&fs->cwdLock, NULL);
+   pthread_mutex_init(&fs->loadLock, NULL);
+   pthread_mutex_init(&fs->writerLock, NULL);
+   pthread_mutex_init(&fs->scanLock, NULL);
+   pthread_mutex_init(&fs->cacheLock, NULL);
+   pthread_cond_init(&fs->groupLoaded, NULL);
+   for (int i = 0; i < DIRLOCKSHARDS; i++)
+      pthread_mutex_init(&fs->dirLocks[i], NULL);
+   
+   dropAllDirIndexes(fs);
+   dropAllDentries(fs);
+   return fs;
 }
 
+//Release context and its disk. A mapped image is flushed first,
+//no handle may be open on the context any more.
+void fs_destroy(fs_t * fs)
+{
+   if (fs == NULL)
+      return;
+   
+   fs_io_stop(fs);
+   if (fs->diskIsMapped) {
+      commitDisk(fs);
+      munmap(fs->virtualDisk, fs->diskSize);
+      close(fs->diskFd);
+   }
+   dropImage(fs);
+   free(fs->loadedGroups);
+   free(fs->loadingGroups);
+   free(fs->memoryDisk);
+   free(fs->FAT);
+   free(fs->freeBitmap);
+   free(fs->unscrubbedBlocks);
+   free(fs->heldBlocks);
+   free(fs->dirBlocks);
+   free(fs->keptBlocks);
+   free(fs->freeAtCommit);
+   free(fs->metadataBlocks);
+   free(fs->changedBlocks);
+   free(fs->unsyncedBlocks);
+   free(fs->fatBlockDirty);
+   free(fs->cacheRing);
+   free(fs->cachedLines);
+   free(fs->referencedLines);
+   for (int i = 0; i < DIRINDEXSLOTS; i++)
+   {
+      free(fs->dirIndexes[i].buckets);
+      free(fs->dirIndexes[i].hashes);
+   }
+   
+   pthread_rwlock_destroy(&fs->volumeLock);
+   pthread_mutex_destroy(&fs->fatLock);
+   pthread_mutex_destroy(&fs->dentryLock);
+   pthread_mutex_destroy(&fs->cwdLock);
+   pthread_mutex_destroy(&fs->loadLock);
+   pthread_mutex_destroy(&fs->writerLock);
+   pthread_mutex_destroy(&fs->scanLock);
+   pthread_mutex_destroy(&fs->cacheLock);
+   pthread_cond_destroy(&fs->groupLoaded);
+   for (int i = 0; i < DIRLOCKSHARDS; i++)
+      pthread_mutex_destroy(&fs->dirLocks[i]);
+   free(fs);
+}
 
-/*****
-   FUNCTIONS FOR GCS C3-C1 BELOW
-*****/
+/* statistics
+ * 
+ * Built with FS_STATS defined, a context counts blocks borrowed in place,
+ * bytes moved by handles, FAT flushes, free block searches, blocks freed and
+ * zeroed, chain hops and path lookups, and times the flushes. Counters are
+ * updated with relaxed atomics from any thread, so a snapshot is only
+ * consistent when the context is idle. Built without it, counting compiles
+ * to nothing and fs_get_stats reports STATS_DISABLED.
+ */
 
-void loadBlock(diskBlock_t * block, int block_address)
+#ifdef FS_STATS
+uint64_t nanoseconds()
 {
-   memmove(block->data, virtualDisk[block_address].data, BLOCKSIZE);
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
+#endif
 
-void readFAT()
+//Copy counters of fs to stats.
+//returns 0, or STATS_DISABLED with stats zeroed if built without FS_STATS
+int fs_get_stats(fs_t * fs, fs_stats_t * stats)
 {
-   loadBlock((diskBlock_t*)(fatBlock_t*)&FAT, 1);
-   loadBlock((diskBlock_t*)((uintptr_t)(diskBlock_t*)(fatBlock_t*)&FAT + sizeof(diskBlock_t)), 2);
+#ifdef FS_STATS
+   const uint64_t * from = (const uint64_t *)&fs->stats;
+   uint64_t * to = (uint64_t *)stats;
+   for (size_t i = 0; i < sizeof(fs_stats_t) / sizeof(uint64_t); i++)
+      to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+   return 0;
+#else
+   (void)fs;
+   memset(stats, 0, sizeof(fs_stats_t));
+   return STATS_DISABLED;
+#endif
 }
 
-
-void zeroOutBlock(int index)
+void fs_reset_stats(fs_t * fs)
 {
-   diskBlock_t block;
-   memset(&block, 0x0, BLOCKSIZE);
-	writeBlock(&block, index);
+#ifdef FS_STATS
+   uint64_t * counters = (uint64_t *)&fs->stats;
+   for (size_t i = 0; i < sizeof(fs_stats_t) / sizeof(uint64_t); i++)
+      __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+#else
+   (void)fs;
+#endif
 }
 
-void clearChain(int index)
+//Print counters of fs to out, one "name value" line each.
+void fs_dump_stats(fs_t * fs, FILE * out)
 {
-   int next = FAT[index];
+   static const struct { const char * name; size_t offset; } fields[] = {
+      #define FIELD(name) { #name, offsetof(fs_stats_t, name) }
+      FIELD(blockViews), FIELD(blockEdits), FIELD(bytesRead), FIELD(bytesWritten),
+      FIELD(fatFlushes), FIELD(fatBlocksFlushed), FIELD(fatFlushTime),
+      FIELD(freeBlockSearches), FIELD(freeBlockWordsScanned),
+      FIELD(freeRunSearches), FIELD(freeRunBlocksScanned),
+      FIELD(blocksFreed), FIELD(blocksZeroed),
+      FIELD(journalCommits), FIELD(journalBlocksWritten), FIELD(groupsLoaded), FIELD(ioRequests),
+      FIELD(chainHops), FIELD(pathComponents), FIELD(dentryHits), FIELD(dentryMisses),
+      FIELD(dirIndexHits), FIELD(dirScans), FIELD(cacheEvictions), FIELD(cacheWriteBacks)
+      #undef FIELD
+   };
+   fs_stats_t stats;
    
-   FAT[index] = UNUSED;
-   zeroOutBlock(index);
-   
-   if (next != ENDOFCHAIN) {
-      clearChain(next);
-   } else {
-      copyFAT();
+   if (fs_get_stats(fs, &stats) == STATS_DISABLED) {
+      fprintf(out, "stats disabled, build with FS_STATS\n");
+      return;
    }
+   for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+      fprintf(out, "%-22s %llu\n", fields[i].name,
+              (unsigned long long)*(const uint64_t *)((const Byte *)&stats + fields[i].offset));
 }
 
 
-//Provided with any block, finds last block of the chain.
-int getEndOfChainIndex(int index)
+/* errors and messages
+ * 
+ * The library prints nothing. A call which fails returns FS_FAILED (or NULL,
+ * or the failure constant it always had) and leaves the reason, one of the
+ * FS_ERR codes, to fs_last_error. Like errno, the code is kept per thread and
+ * is not cleared by calls which succeed. Errors and notable events are also
+ * described to the log callback of the context, if one is set; without one
+ * no message is even formatted.
+ */
+
+__thread int lastError = FS_OK;
+
+//Set callback receiving messages of fs, NULL turns them off.
+//Must not be called while other threads use the context. The callback
+//can be called with locks of the context held, it must not call into it.
+void fs_set_log(fs_t * fs, fs_log_t log, void * context)
 {
-   while (FAT[index] != ENDOFCHAIN)
-      index = FAT[index];
-   return index;  
+   fs->log = log;
+   fs->logContext = context;
 }
 
-void setCurrentDirToRoot()
+//returns reason of the last failed call made by this thread
+int fs_last_error()
 {
-   currentDirIndex = rootDirIndex;
-   currentDir = NULL;
-   printf("\nCurrent dir: root");
+   return lastError;
 }
 
-
-int findEntryByName(int dirBlockIndex, const char * filename)
+const char * fs_strerror(int error)
 {
-   //load needed dirblock in memory
-   diskBlock_t dirBlock;
-   loadBlock(&dirBlock, dirBlockIndex);
-   
-   //iterate over entryList
-   for (int i = 0; i < dirBlock.dir.nextEntry; i++)
+   switch (error)
    {
-      //compare filename from entry number i to the one provided
-      if ((strcmp(dirBlock.dir.entryList[i].name, filename) == 0) && (dirBlock.dir.entryList[i].unUsed == 0))
-      {
-         return i;
-      }
-      
+      case FS_OK:                return "no error";
+      case FS_ERR_NOT_FOUND:     return "file or folder not found";
+      case FS_ERR_EXISTS:        return "existing folder or file collides with given name";
+      case FS_ERR_NOT_DIR:       return "not a folder";
+      case FS_ERR_IS_DIR:        return "path leads to a folder";
+      case FS_ERR_NOT_EMPTY:     return "folder is not empty";
+      case FS_ERR_BUSY:          return "folder is the current directory";
+      case FS_ERR_BAD_PATH:      return "path is incorrect";
+      case FS_ERR_NAME_TOO_LONG: return "name in path is too long";
+      case FS_ERR_INVALID:       return "invalid argument";
+      case FS_ERR_NO_SPACE:      return "no room left on the disk";
+      case FS_ERR_NO_MEMORY:     return "out of memory";
+      case FS_ERR_IO:            return "file on the real disk cannot be used";
+      case FS_ERR_CORRUPT:       return "disk image has no valid superblock";
+      default:                   return "unknown error";
    }
-   return FILE_NOT_FOUND;
 }
 
-int countBlocksInChain(int index)
+void logMessage(fs_t * fs, int level, const char * format, ...)
 {
-   int numberOfBlocks = 1;
+   if (fs->log == NULL)
+      return;
    
-   while (FAT[index] != ENDOFCHAIN)
-   {
-      index = FAT[index];
-      numberOfBlocks++;
-   }
-   return numberOfBlocks;
+   char message[MAXPATHLENGTH + 64];
+   va_list args;
+   va_start(args, format);
+   vsnprintf(message, sizeof(message), format, args);
+   va_end(args);
+   fs->log(level, message, fs->logContext);
 }
 
-//Just iterate over FAT table until find something unused.
-//If nothing found return NO_FREE_BLOCKS.
-int findFreeBlock()
+//Record error for fs_last_error and log it, with what as the subject if not NULL.
+//returns FS_FAILED
+int fail(fs_t * fs, int error, const char * what)
 {
-   for (int i = 3; i < MAXBLOCKS; i++)
-   {
-      if (FAT[i] == UNUSED)
-      {
-         return i;
-      }
-   }
-   return NO_FREE_BLOCKS;
+   lastError = error;
+   if (what != NULL)
+      logMessage(fs, FS_LOG_ERROR, "Error: %s: %s", what, fs_strerror(error));
+   else
+      logMessage(fs, FS_LOG_ERROR, "Error: %s", fs_strerror(error));
+   return FS_FAILED;
 }
 
-//Check if input for fopen is correct
-int validateInputForFOpen(int directoryBlockIndex, const char * filename, const char mode)
-//return index of entry of file, if found
-//return FILE_NOT_FOUND_IN_W_OR_A_MODE, if file not found but mode is write or append
-//return VALIDATION_FAILED otherwise
+
+/* volume geometry
+ * 
+ * Block count, block size and FAT width are taken from volume, which is set
+ * by format or from the superblock of a disk which is read or mapped, and
+ * read through blockCount, blockSize and the helpers derived from them.
+ */
+
+int isValidGeometry(const geometry_t * geometry)
 {
-   //Check input mode
-   if ((mode != 'r') && (mode != 'w') && (mode != 'a'))
-      return VALIDATION_FAILED;
-      
-   //Load current dir for validation below
-   diskBlock_t currDirBlock;
-   loadBlock(&currDirBlock, directoryBlockIndex);
-    
-   //Find file by name in current dir
-   int entryIndex = findEntryByName(directoryBlockIndex, filename);
+   int blockSize = geometry->blockSize;
    
-   //If file not found and in reading mode
-   if ((entryIndex == FILE_NOT_FOUND) && (mode == 'r'))
-      return VALIDATION_FAILED;
-      
-   //If file found, but is a directory
-   if ((entryIndex != FILE_NOT_FOUND) && (currDirBlock.dir.entryList[entryIndex].isDir))
-      return VALIDATION_FAILED;
+   if ((geometry->fatWidth != 16) && (geometry->fatWidth != 32))
+      return 0;
+   if ((blockSize < MINBLOCKSIZE) || (blockSize > MAXBLOCKSIZE) || (blockSize & (blockSize - 1)))
+      return 0;
+   //a 16-bit FAT entry cannot address blocks past 32767
+   if ((geometry->fatWidth == 16) && (geometry->blockCount > 32768))
+      return 0;
    
-   //If file not found but mode is append or write
-   if ((entryIndex == FILE_NOT_FOUND) && ((mode == 'a') || (mode == 'w')))
-      return FILE_NOT_FOUND_IN_W_OR_A_MODE;
-      
-   return entryIndex;
+   //a journal holds a header and at least one block
+   if ((geometry->journalBlocks < 0) || (geometry->journalBlocks == 1))
+      return 0;
+   
+   //superblock, FAT, journal and root directory have to fit
+   int fatBlocks = (geometry->blockCount + blockSize / (geometry->fatWidth / 8) - 1) / (blockSize / (geometry->fatWidth / 8));
+   return geometry->blockCount > fatBlocks + geometry->journalBlocks + 2;
 }
 
-void fillDirEntry(dirEntry_t * dirEntry_ptr, const char * filename, int isDir, int firstBlock)
+//Read geometry recorded in superblock.
+//returns 1 if the superblock describes a valid volume, 0 otherwise
+int geometryFromSuperBlock(const superBlock_t * super, geometry_t * geometry)
 {
-   dirEntry_ptr->entryLength = 0xFFFFFFFF;
-   dirEntry_ptr->isDir = isDir;
-   dirEntry_ptr->unUsed = 0;
-   dirEntry_ptr->modTime = time(NULL);
-   dirEntry_ptr->fileLength = 0;
-   dirEntry_ptr->firstBlock = firstBlock;
-   strcpy(dirEntry_ptr -> name, filename);
+   if (super->magic != SUPERBLOCKMAGIC)
+      return 0;
+   
+   geometry->blockCount = super->blockCount;
+   geometry->blockSize = super->blockSize;
+   geometry->fatWidth = super->fatWidth;
+   geometry->journalBlocks = super->journalBlocks;
+   return (super->journalBlocks <= INT32_MAX) && isValidGeometry(geometry);
 }
 
-int allocateNewEntry(int directoryBlockIndex, const char * filename, int isDir)
+//Switch to given geometry, resizing in-memory structures which depend on it.
+//returns 0 on success, -1 if out of memory
+int setupVolume(fs_t * fs, const geometry_t * geometry)
 {
-   //Filename length checker
-   if (!(strlen(filename) < MAXNAME))
-      return ALLOCATION_FAILED;
+   dropImage(fs);
+   fs->volume = *geometry;
    
-   //load block of directory in which entry is created
-   diskBlock_t temp;
-   loadBlock(&temp, directoryBlockIndex);
+   fs->FAT = realloc(fs->FAT, blockCount(fs) * sizeof(fatEntry_t));
+   fs->freeBitmap = realloc(fs->freeBitmap, bitmapWords(fs) * sizeof(uint64_t));
+   fs->unsyncedBlocks = realloc(fs->unsyncedBlocks, bitmapWords(fs) * sizeof(uint64_t));
+   fs->unscrubbedBlocks = realloc(fs->unscrubbedBlocks, bitmapWords(fs) * sizeof(uint64_t));
+   fs->heldBlocks = realloc(fs->heldBlocks, bitmapWords(fs) * sizeof(uint64_t));
+   fs->dirBlocks = realloc(fs->dirBlocks, bitmapWords(fs) * sizeof(uint64_t));
+   fs->keptBlocks = realloc(fs->keptBlocks, bitmapWords(fs) * sizeof(uint64_t));
+   fs->freeAtCommit = realloc(fs->freeAtCommit, bitmapWords(fs) * sizeof(uint64_t));
+   fs->metadataBlocks = realloc(fs->metadataBlocks, bitmapWords(fs) * sizeof(uint64_t));
+   fs->changedBlocks = realloc(fs->changedBlocks, bitmapWords(fs) * sizeof(uint64_t));
+   fs->fatBlockDirty = realloc(fs->fatBlockDirty, fatBlockCount(fs));
+   if ((fs->FAT == NULL) || (fs->freeBitmap == NULL) || (fs->unsyncedBlocks == NULL)
+         || (fs->unscrubbedBlocks == NULL) || (fs->metadataBlocks == NULL) || (fs->changedBlocks == NULL)
+         || (fs->heldBlocks == NULL) || (fs->freeAtCommit == NULL) || (fs->fatBlockDirty == NULL)
+         || (fs->dirBlocks == NULL) || (fs->keptBlocks == NULL))
+      return -1;
    
-   //index pointing to free entry in directory's entryList
-   int freeEntry = -1;
-   
-   //Check if there's space for new entry
-   if (temp.dir.nextEntry >= DIRENTRYCOUNT)
-   {
-      //If there's no space, maybe a unused entry?
-      for (int i = 0; i < DIRENTRYCOUNT; i++)
-      {
-         if (temp.dir.entryList[i].unUsed == 1)
-         {
-            freeEntry = i;
-            break;
-         }
-      }
+   memset(fs->unsyncedBlocks, 0x0, bitmapWords(fs) * sizeof(uint64_t));
+   memset(fs->metadataBlocks, 0x0, bitmapWords(fs) * sizeof(uint64_t));
+   memset(fs->changedBlocks, 0x0, bitmapWords(fs) * sizeof(uint64_t));
+   fs->checkpointSequence = 0;
+   memset(fs->unscrubbedBlocks, 0x0, bitmapWords(fs) * sizeof(uint64_t));
+   memset(fs->fatBlockDirty, 0x0, fatBlockCount(fs));
+   forgetDirBlocks(fs);
+   dropAllDirIndexes(fs);
+   dropAllDentries(fs);
+   return setupCache(fs);
+}
+
+//Make virtualDisk size bytes long, on the mapped image or in memory.
+//If discard is set, previous content is not kept and the disk reads as zeros.
+//returns 0 on success, -1 otherwise
+int resizeDisk(fs_t * fs, size_t size, int discard)
+{
+   if (fs->diskIsMapped) {
+      if (fs->virtualDisk != NULL)
+         munmap(fs->virtualDisk, fs->diskSize);
+      fs->virtualDisk = NULL;
+      fs->diskSize = 0;
       
-      //if didn't find anything unused return fail
-      if (freeEntry == -1)
-      {
-         return ALLOCATION_FAILED;
-      }
+      //an image is not cut short, a transaction may be kept past its end, see commitTransaction
+      struct stat info;
+      if ((discard && (ftruncate(fs->diskFd, 0) != 0)) || (fstat(fs->diskFd, &info) != 0)
+            || ((info.st_size < (off_t)size) && (ftruncate(fs->diskFd, size) != 0)))
+         return -1;
+      //changes to a journaled image reach the file only through commitDisk
+      int sharing = (fs->volume.journalBlocks > 0) ? MAP_PRIVATE : MAP_SHARED;
+      void * mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, sharing, fs->diskFd, 0);
+      if (mapping == MAP_FAILED)
+         return -1;
+      fs->virtualDisk = mapping;
    } else {
-      //if entryList not full we can allocate the entryList[ nextEntry ]
-      freeEntry = temp.dir.nextEntry;
-      
-      //if new entry is allocated then nextEntry must be shifted
-      temp.dir.nextEntry++;
+      if (discard) {
+         free(fs->memoryDisk);
+         fs->memoryDisk = calloc(size, 1);
+      } else {
+         fs->memoryDisk = realloc(fs->memoryDisk, size);
+      }
+      fs->virtualDisk = fs->memoryDisk;
+      if (fs->memoryDisk == NULL)
+         return -1;
    }
-      
-   //Find free block to allocate file
-   int index = findFreeBlock();
-   
-   // If any free block was found, its index was returned
-   // If not, NO_FREE_BLOCKS was returned and func cannot proceed
-   if (index == NO_FREE_BLOCKS)
-      return ALLOCATION_FAILED;
-      
-   //Updating FAT table
-   FAT[index] = ENDOFCHAIN;
-   copyFAT();
+   fs->diskSize = size;
+   return 0;
+}
+
+//Address of a block of the virtual disk
+diskBlock_t * blockAddress(fs_t * fs, int block_address)
+{
+   if (fs->imageFd >= 0)
+      loadGroupOf(fs, block_address);
+   return (diskBlock_t *)(fs->virtualDisk + (size_t)block_address * blockSize(fs));
+}
+
+//Address of count consecutive blocks beginning with first, for access to all of them at once.
+diskBlock_t * blockRange(fs_t * fs, int first, int count)
+{
+   for (int i = first + LAZYGROUPBLOCKS; (fs->imageFd >= 0) && (i < first + count); i += LAZYGROUPBLOCKS)
+      loadGroupOf(fs, i);
+   if ((fs->imageFd >= 0) && (count > 0))
+      loadGroupOf(fs, first + count - 1);
+   return blockAddress(fs, first);
+}
+
+
+/* lazy loading
+ * 
+ * readDisk only reads the superblock, FAT and root directory of an image.
+ * The rest stays in the image file and a group of LAZYGROUPBLOCKS blocks is
+ * read into the in-memory disk the first time blockAddress is asked for any
+ * of its blocks, so blocks never used are never read. The image must not be
+ * changed by others meanwhile; writeDisk and writeDiskIncremental load the
+ * rest first when they are about to overwrite it.
+ */
+
+//Load the group of block_address from imageFd, unless it is loaded.
+//Different groups are loaded by different threads at once, a thread which
+//needs a group another one is loading waits for it.
+//returns 0, or -1 if the image could not be read, the group then reads as zeros
+int loadGroupOf(fs_t * fs, int block_address)
+{
+   int group = block_address / LAZYGROUPBLOCKS;
+   uint64_t bit = (uint64_t)1 << (group % 64);
+   if (__atomic_load_n(&fs->loadedGroups[group / 64], __ATOMIC_ACQUIRE) & bit)
+      return 0;
    
-   //UPDATING dirEntry below
-      //filling dirEntry structure
-   fillDirEntry(&(temp.dir.entryList[ freeEntry ]), filename, isDir, index);
+   pthread_mutex_lock(&fs->loadLock);
+   if (fs->loadingGroups[group / 64] & bit) {
+      while (!(fs->loadedGroups[group / 64] & bit))
+         pthread_cond_wait(&fs->groupLoaded, &fs->loadLock);
+   }
+   if (fs->loadedGroups[group / 64] & bit) {
+      pthread_mutex_unlock(&fs->loadLock);
+      return 0;
+   }
+   fs->loadingGroups[group / 64] |= bit;
+   pthread_mutex_unlock(&fs->loadLock);
    
-   //if dir then initial structure has to be set 
-   if (isDir == 1) {
-      diskBlock_t newRootDir;
-      memset(&newRootDir, 0x0, BLOCKSIZE);
-      newRootDir.dir.isDir = 1;
-      newRootDir.dir.parentBlockIndex = directoryBlockIndex;
-      newRootDir.dir.nextEntry = 0;
-      //Write it to the disk
-      writeBlock(&newRootDir, index);
+   int result = 0;
+   int first = group * LAZYGROUPBLOCKS;
+   int count = (first + LAZYGROUPBLOCKS < blockCount(fs)) ? LAZYGROUPBLOCKS : blockCount(fs) - first;
+   Byte * dest = fs->virtualDisk + (size_t)first * blockSize(fs);
+   size_t size = (size_t)count * blockSize(fs);
+   off_t offset = (off_t)first * blockSize(fs);
+   while (size > 0)
+   {
+      ssize_t got = pread(fs->imageFd, dest, size, offset);
+      if (got <= 0) {
+         logMessage(fs, FS_LOG_ERROR, "Blocks %d to %d could not be loaded.", first, first + count - 1);
+         result = -1;
+         break;
+      }
+      dest += got;
+      size -= got;
+      offset += got;
    }
+   COUNT(fs, groupsLoaded, 1);
    
-   //writing the block black into virutal disk
-   writeBlock(&temp, directoryBlockIndex);
+   pthread_mutex_lock(&fs->loadLock);
+   fs->loadingGroups[group / 64] &= ~bit;
+   __atomic_fetch_or(&fs->loadedGroups[group / 64], bit, __ATOMIC_RELEASE);
+   pthread_cond_broadcast(&fs->groupLoaded);
+   pthread_mutex_unlock(&fs->loadLock);
+   return result;
+}
+
+//Load every block not loaded yet and let go of the image.
+//Caller holds the volume exclusively.
+//returns 0 on success, FS_ERR_IO if some blocks could not be read
+int loadAllBlocks(fs_t * fs)
+{
+   if (fs->imageFd < 0)
+      return 0;
    
-   //returning index of allocated file in its parent's entrylist
-   return freeEntry;
+   int result = 0;
+   for (int i = 0; i < blockCount(fs); i += LAZYGROUPBLOCKS)
+   {
+      if (loadGroupOf(fs, i) != 0)
+         result = FS_ERR_IO;
+   }
+   dropImage(fs);
+   return result;
+}
+
+//Load the rest of the image before filename, which may be the image, is overwritten.
+//Caller holds the volume exclusively.
+//returns 0 on success, FS_ERR_IO otherwise
+int releaseImage(fs_t * fs, const char * filename)
+{
+   struct stat image, target;
+   if ((fs->imageFd < 0) || (stat(filename, &target) != 0) || (fstat(fs->imageFd, &image) != 0)
+         || (image.st_dev != target.st_dev) || (image.st_ino != target.st_ino))
+      return 0;
+   return loadAllBlocks(fs);
 }
 
+//Stop loading from the image, blocks not loaded yet are given up.
+void dropImage(fs_t * fs)
+{
+   if (fs->imageFd >= 0)
+      close(fs->imageFd);
+   fs->imageFd = -1;
+}
 
 
+/* writeDisk : writes virtual disk out to physical disk
+ * 
+ * in: context, file name of stored virtual disk
+ * returns: 0 on success, FS_FAILED otherwise
+ */
 
-MyFILE * myfopen(const char * path, const char mode)
+int writeDisk ( fs_t * fs, const char * filename )
 {
-   folderAndEntry details = getDetailsFromPath(path);
+   lockVolumeExclusive(fs);
+   //every block is written out, and filename may be the image still being loaded
+   FILE * dest = NULL;
+   int result = loadAllBlocks(fs);
+   if ((result == 0) && ((dest = fopen( filename, "w" )) == NULL))
+      result = FS_ERR_IO;
+   if (result != 0) {
+      unlockVolume(fs);
+      return fail(fs, result, filename);
+   }
    
-   if (details.pathToFolderFound == 0) {
-      printf("\nError: path to folder not found.");
-      return NULL;
+   //the image is a new base for incremental checkpoints
+   editMetaBlock(fs, 0)->super.snapshotId = newSnapshotId(fs);
+   copyFAT(fs);
+   //the image is written out whole anyway, leave no leftovers of removed files in it
+   lockFAT(fs);
+   scrubBlocks(fs, 0);
+   unlockFAT(fs);
+   
+   holdWriters(fs);
+   if ( fwrite ( fs->virtualDisk, blockSize(fs), blockCount(fs), dest ) < (size_t)blockCount(fs) )
+      result = FS_ERR_IO;
+   if (result == 0) {
+      memset(fs->changedBlocks, 0x0, bitmapWords(fs) * sizeof(uint64_t));
+      fs->checkpointSequence = 0;
    }
+   releaseWriters(fs);
+   unlockVolume(fs);
+   if (fclose(dest) != 0)
+      result = FS_ERR_IO;
+   
+   if (result != 0)
+      return fail(fs, result, filename);
+   logMessage(fs, FS_LOG_INFO, "Disk has been saved.");
+   return 0;
+}
+
+/* readDisk : loads a disk stored by writeDisk as the volume of a context
+ * 
+ * Only the superblock, the whole FAT and the root directory are read at
+ * once, other blocks are read on first use, see lazy loading. The FAT is
+ * not loaded lazily, so mounting still takes time in proportion to its
+ * size, fatWidth / 8 bytes per block of the volume; the free space index
+ * is built from it on the way.
+ * 
+ * in: context, file name of the image
+ * returns: 0 on success, FS_FAILED if the image cannot be read or is not
+ *          valid, the volume is kept then
+ */
+
+int readDisk ( fs_t * fs, const char * filename )
+{
+   lockVolumeExclusive(fs);
+   int result = loadDisk(fs, filename);
+   unlockVolume(fs);
    
-   char * filename = malloc(sizeof(details.entryName) + 1);
-   strcpy(filename, details.entryName);
+   if (result != 0)
+      return fail(fs, result, filename);
+   return 0;
+}
+
+//Load image stored by writeDisk as the volume, see lazy loading.
+//Caller holds the volume exclusively.
+//returns 0 on success, error code otherwise, the volume is kept if the image is not valid
+int loadDisk(fs_t * fs, const char * filename)
+{
+   int fd = open( filename, O_RDONLY ) ;
+   if (fd < 0)
+      return FS_ERR_IO;
    
-   int blockIndex = details.folderFirstBlock;
+   //geometry is needed before the rest of the disk can be read
+   struct stat info;
+   superBlock_t super;
+   geometry_t geometry;
+   if ((fstat(fd, &info) != 0) || (pread(fd, &super, sizeof(super), 0) != sizeof(super))
+         || !geometryFromSuperBlock(&super, &geometry)) {
+      close(fd) ;
+      return FS_ERR_CORRUPT;
+   }
+   if (info.st_size < (off_t)geometry.blockCount * geometry.blockSize) {
+      close(fd) ;
+      return FS_ERR_IO;
+   }
    
-   int result = validateInputForFOpen(blockIndex, filename, mode);
+   if (fs->diskIsMapped && (releaseMapping(fs) != 0) && fs->diskIsMapped) {
+      close(fd) ;
+      return FS_ERR_NO_MEMORY;
+   }
+   if ((setupVolume(fs, &geometry) != 0) || (resizeDisk(fs, (size_t)blockCount(fs) * blockSize(fs), 1) != 0)
+         || ((fs->loadedGroups = realloc(fs->loadedGroups, lazyGroupWords(fs) * sizeof(uint64_t))) == NULL)
+         || ((fs->loadingGroups = realloc(fs->loadingGroups, lazyGroupWords(fs) * sizeof(uint64_t))) == NULL)) {
+      close(fd) ;
+      return FS_ERR_NO_MEMORY;
+   }
    
-   if (result == VALIDATION_FAILED)
-      return NULL;
-      
-   int entryIndex = -1;
+   //nothing is read yet, blocks are loaded as they are used
+   memset(fs->loadedGroups, 0x0, lazyGroupWords(fs) * sizeof(uint64_t));
+   memset(fs->loadingGroups, 0x0, lazyGroupWords(fs) * sizeof(uint64_t));
+   fs->imageFd = fd;
+   replayJournal(fs);
+   attachDisk(fs);
+   return 0;
+}
+
+
+/* incremental checkpoints
+ * 
+ * Every written block is also marked in changedBlocks, which writeDisk
+ * clears. writeDiskIncremental stores only the blocks marked since the last
+ * checkpoint, as runs of consecutive blocks in a delta file, so its cost
+ * follows the write set rather than the size of the volume. A delta names
+ * the full image it builds on by the snapshotId writeDisk put into its
+ * superblock, and its place in the sequence of deltas taken since then;
+ * readDiskDeltas loads an image and applies its deltas in that order.
+ */
+
+//A new identity for a full image.
+uint32_t newSnapshotId(fs_t * fs)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   uint32_t id = (uint32_t)ts.tv_sec * 2654435761u ^ (uint32_t)ts.tv_nsec ^ (uint32_t)(uintptr_t)fs;
+   //0 is left for images saved before snapshots had identities
+   return (id == 0) ? 1 : id;
+}
+
+/* writeDiskIncremental : writes blocks changed since last checkpoint out to a delta file
+ * 
+ * The first checkpoint of a volume must be a full one made by writeDisk.
+ * If the delta cannot be written, its blocks stay marked for the next one.
+ * 
+ * in: context, file name of the delta
+ * returns: 0 on success, FS_FAILED otherwise
+ */
+
+int writeDiskIncremental ( fs_t * fs, const char * filename )
+{
+   lockVolumeExclusive(fs);
+   FILE * dest = NULL;
+   int result = releaseImage(fs, filename);
+   if ((result == 0) && ((dest = fopen( filename, "w" )) == NULL))
+      result = FS_ERR_IO;
+   if (result != 0) {
+      unlockVolume(fs);
+      return fail(fs, result, filename);
+   }
    
-   //if validation returned entryIndex, store it
-   if (result > -1)
-      entryIndex = result;
+   uint32_t snapshotId = blockAddress(fs, 0)->super.snapshotId;
+   uint64_t * changed = malloc(bitmapWords(fs) * sizeof(uint64_t));
+   if (snapshotId == 0)
+      result = FS_ERR_INVALID;
+   else if (changed == NULL)
+      result = FS_ERR_NO_MEMORY;
    
-   diskBlock_t currDirBlock;
-   loadBlock(&currDirBlock, blockIndex);
-      
-   //if validation returned file not found in write or append mode
-   //create file and store its index in entryIndex
-   if (result == FILE_NOT_FOUND_IN_W_OR_A_MODE)
-   {
-      entryIndex = allocateNewEntry(blockIndex, filename, 0);
+   if (result == 0) {
+      copyFAT(fs);
+      //like writeDisk, leave no leftovers of removed files in the checkpoint
+      lockFAT(fs);
+      scrubBlocks(fs, 0);
+      unlockFAT(fs);
       
-      if (entryIndex == ALLOCATION_FAILED)
+      //count runs of consecutive changed blocks
+      deltaHeader_t header = { DELTAMAGIC, blockCount(fs), blockSize(fs), snapshotId, fs->checkpointSequence + 1, 0 };
+      holdWriters(fs);
+      for (int w = 0; w < bitmapWords(fs); w++)
       {
-         printf("\nAllocation failed: no room for new file?");
-         return NULL;
+         changed[w] = __atomic_exchange_n(&fs->changedBlocks[w], 0, __ATOMIC_ACQ_REL);
+         //a run begins at every set bit whose predecessor is clear
+         uint64_t carry = (w > 0) ? changed[w - 1] >> 63 : 0;
+         header.runCount += __builtin_popcountll(changed[w] & ~((changed[w] << 1) | carry));
       }
+      if (fwrite(&header, sizeof(header), 1, dest) < 1)
+         result = FS_ERR_IO;
       
-      //reload dirblock after entry allocation
-      loadBlock(&currDirBlock, blockIndex);
-   } else if (mode == 'w') {
-      //if file found but in write mode it has to be gotten rid of
-      
-      //clear FAT chain
-      clearChain(currDirBlock.dir.entryList[entryIndex].firstBlock);
-      //set entry to unused
-      currDirBlock.dir.entryList[entryIndex].unUsed = 1;
-      //save dir block
-      writeBlock(&currDirBlock, blockIndex);
-      
-      
-      //allocate new entry
-      entryIndex = allocateNewEntry(blockIndex, filename, 0);
-      
-      //reload dirBlock after entry allocation
-      loadBlock(&currDirBlock, blockIndex);
-      
-      if (entryIndex == ALLOCATION_FAILED)
-         return NULL;
+      int runStart = -1;
+      for (int i = 0; (i <= blockCount(fs)) && (result == 0); i++)
+      {
+         int isChanged = (i < blockCount(fs)) && ((changed[i / 64] >> (i % 64)) & 1);
+         if (isChanged && (runStart == -1))
+            runStart = i;
+         if (!isChanged && (runStart != -1))
+         {
+            deltaRun_t run = { runStart, i - runStart };
+            if ((fwrite(&run, sizeof(run), 1, dest) < 1)
+                  || (fwrite(blockRange(fs, runStart, run.blockCount), blockSize(fs), run.blockCount, dest) < run.blockCount))
+               result = FS_ERR_IO;
+            runStart = -1;
+         }
+      }
+      releaseWriters(fs);
    }
+   if ((fclose(dest) != 0) && (result == 0))
+      result = FS_ERR_IO;
    
+   if (result == 0) {
+      fs->checkpointSequence++;
+   } else if (changed != NULL) {
+      //keep blocks of the failed delta for the next one
+      for (int w = 0; w < bitmapWords(fs); w++)
+         __atomic_fetch_or(&fs->changedBlocks[w], changed[w], __ATOMIC_RELEASE);
+   }
+   free(changed);
+   unlockVolume(fs);
    
+   if (result != 0)
+      return fail(fs, result, filename);
+   return 0;
+}
+
+//Check delta file fits the volume as delta number sequence of its image.
+//returns 0 if it does, error code otherwise
+int checkDelta(fs_t * fs, FILE * delta, uint32_t sequence)
+{
+   deltaHeader_t header;
+   if ((fread(&header, sizeof(header), 1, delta) < 1) || (header.magic != DELTAMAGIC))
+      return FS_ERR_CORRUPT;
+   if ((header.blockCount != (uint32_t)blockCount(fs)) || (header.blockSize != (uint32_t)blockSize(fs))
+         || (header.snapshotId != blockAddress(fs, 0)->super.snapshotId) || (header.sequence != sequence))
+      return FS_ERR_INVALID;
+   
+   //every run must lie within the volume and be complete
+   for (uint32_t i = 0; i < header.runCount; i++)
+   {
+      deltaRun_t run;
+      if ((fread(&run, sizeof(run), 1, delta) < 1) || (run.blockCount == 0)
+            || (run.first >= header.blockCount) || (run.blockCount > header.blockCount - run.first)
+            || (fseek(delta, (long)run.blockCount * blockSize(fs), SEEK_CUR) != 0))
+         return FS_ERR_CORRUPT;
+   }
+   long end = ftell(delta);
+   if ((fseek(delta, 0, SEEK_END) != 0) || (ftell(delta) != end))
+      return FS_ERR_CORRUPT;
+   return 0;
+}
+
+/* readDiskDeltas : reads a disk stored by writeDisk, then applies deltas
+ *                  stored by writeDiskIncremental since, in order
+ * 
+ * Each delta is checked before any of it is applied, so a missing, foreign,
+ * out of order or truncated delta leaves the volume at the last good one.
+ * 
+ * in: context, file name of the image, file names of count deltas
+ * returns: number of deltas applied, FS_FAILED if the image could not be read
+ *          or not all deltas could be applied
+ */
+
+int readDiskDeltas ( fs_t * fs, const char * filename, const char * const * deltas, int count )
+{
+   lockVolumeExclusive(fs);
+   int result = loadDisk(fs, filename);
+   const char * failed = filename;
+   int applied = 0;
+   
+   for (; (applied < count) && (result == 0); applied++)
+   {
+      failed = deltas[applied];
+      FILE * delta = fopen(deltas[applied], "r");
+      if (delta == NULL) {
+         result = FS_ERR_IO;
+         break;
+      }
+      result = checkDelta(fs, delta, applied + 1);
+      
+      //runs are known to be sound, read them into place
+      deltaHeader_t header;
+      if ((result == 0) && ((fseek(delta, 0, SEEK_SET) != 0) || (fread(&header, sizeof(header), 1, delta) < 1)))
+         result = FS_ERR_IO;
+      for (uint32_t i = 0; (result == 0) && (i < header.runCount); i++)
+      {
+         deltaRun_t run;
+         if ((fread(&run, sizeof(run), 1, delta) < 1)
+               || (fread(blockRange(fs, run.first, run.blockCount), blockSize(fs), run.blockCount, delta) < run.blockCount))
+            result = FS_ERR_IO;
+      }
+      fclose(delta);
+      if (result != 0)
+         break;
+      
+      //blocks changed under in-memory state of the image
+      dropAllDirIndexes(fs);
+      dropAllDentries(fs);
+      attachDisk(fs);
+      fs->checkpointSequence = applied + 1;
+   }
+   unlockVolume(fs);
+   
+   if (result != 0) {
+      fail(fs, result, failed);
+      return FS_FAILED;
+   }
+   return applied;
+}
+
+//Set up in-memory state for a disk whose blocks have just been loaded or mapped.
+void attachDisk(fs_t * fs)
+{
+   const superBlock_t * super = &blockAddress(fs, 0)->super;
+   fs->rootDirIndex = super->rootDirIndex;
+   
+   readFAT(fs);
+   //allocation carries on where it stopped, if the summary was written with this FAT
+   if ((super->freeBlocks == (uint32_t)fs->freeBlockCount) && (super->nextFreeHint < (uint32_t)blockCount(fs)))
+      fs->nextFitCursor = super->nextFreeHint;
+   
+   fs->currentDirIndex = fs->rootDirIndex;
+   fs->currentDir = NULL;
+   forgetDirBlocks(fs);
+}
+
+
+/* mapDisk : uses a disk image file directly as the virtual disk
+ * 
+ * The image is mmap'ed, so blocks are borrowed straight from the page cache
+ * and only blocks which were written are flushed by mysync (see commitDisk).
+ * If the volume has a journal, the mapping is private and the image changes
+ * only at mysync, metadata through the journal; a transaction left by a crash
+ * is replayed here. A new or empty image is formatted with default geometry.
+ * 
+ * in: context, file name of disk image
+ * returns: 0 on success, MAPPING_FAILED otherwise
+ */
+
+int mapDisk ( fs_t * fs, const char * filename )
+{
+   int fd = open( filename, O_RDWR | O_CREAT, 0644 ) ;
+   if (fd < 0) {
+      fail(fs, FS_ERR_IO, filename);
+      return MAPPING_FAILED;
+   }
+   
+   //check the image before giving up the disk in use
+   struct stat info;
+   superBlock_t super;
+   geometry_t geometry;
+   if ((fstat(fd, &info) != 0)
+         || ((info.st_size != 0)
+            && ((pread(fd, &super, sizeof(super), 0) != sizeof(super)) || !geometryFromSuperBlock(&super, &geometry)))) {
+      close(fd);
+      fail(fs, FS_ERR_CORRUPT, filename);
+      return MAPPING_FAILED;
+   }
+   
+   lockVolumeExclusive(fs);
+   if (fs->diskIsMapped && (releaseMapping(fs) != 0) && fs->diskIsMapped) {
+      unlockVolume(fs);
+      close(fd);
+      return MAPPING_FAILED;
+   }
+   
+   fs->diskIsMapped = 1;
+   fs->diskFd = fd;
+   fs->virtualDisk = NULL;
+   
+   int result = 0;
+   if (info.st_size == 0) {
+      if ((formatDisk(fs, NULL) != 0) || (commitDisk(fs) != 0))
+         result = MAPPING_FAILED;
+   } else if ((setupVolume(fs, &geometry) != 0) || (resizeDisk(fs, (size_t)blockCount(fs) * blockSize(fs), 0) != 0)) {
+      fail(fs, FS_ERR_IO, filename);
+      result = MAPPING_FAILED;
+   } else {
+      //a transaction interrupted by a crash is finished before the volume is used
+      int replayed = replayJournal(fs);
+      attachDisk(fs);
+      if (replayed && (commitDisk(fs) != 0))
+         result = MAPPING_FAILED;
+      else if (!replayed && (ftruncate(fd, (off_t)fs->diskSize) != 0))
+         logMessage(fs, FS_LOG_ERROR, "Image %s could not be cut back to the volume.", filename);
+   }
+   unlockVolume(fs);
+   return result;
+}
+
+//Mark count blocks from first as not synced again, after writing them failed.
+void markUnsynced(fs_t * fs, int first, int count)
+{
+   for (int i = first; i < first + count; i++)
+      __atomic_fetch_or(&fs->unsyncedBlocks[i / 64], (uint64_t)1 << (i % 64), __ATOMIC_RELEASE);
+}
+
+//Flush blocks written since last call to the image file,
+//one msync per run of consecutive written blocks.
+//returns 0 on success, -1 if some blocks could not be flushed, they are left for next call
+int syncMappedDisk(fs_t * fs)
+{
+   if (!fs->diskIsMapped)
+      return 0;
+   
+   uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+   int runStart = -1;
+   int failed = 0;
+   uint64_t word = 0;
+   
+   holdWriters(fs);
+   for (int i = 0; i <= blockCount(fs); i++)
+   {
+      //take a word of bits at a time, blocks written from now on are left for next call
+      if ((i % 64 == 0) && (i < blockCount(fs)))
+         word = __atomic_exchange_n(&fs->unsyncedBlocks[i / 64], 0, __ATOMIC_ACQ_REL);
+      int unsynced = (i < blockCount(fs)) && ((word >> (i % 64)) & 1);
+      
+      if (unsynced && (runStart == -1))
+         runStart = i;
+      
+      if (!unsynced && (runStart != -1))
+      {
+         //msync needs a page aligned address
+         uintptr_t start = (uintptr_t)blockAddress(fs, runStart) & ~(pageSize - 1);
+         uintptr_t end = (uintptr_t)blockAddress(fs, i);
+         if (msync((void *)start, end - start, MS_SYNC) != 0) {
+            markUnsynced(fs, runStart, i - runStart);
+            failed = 1;
+         }
+         runStart = -1;
+      }
+   }
+   releaseWriters(fs);
+   return failed ? -1 : 0;
+}
+
+/* metadata journal
+ * 
+ * A journaled image is mapped privately, so blocks written in the mapping
+ * reach the image file only when commitDisk writes them. Data blocks are
+ * written to their homes first. Superblock, FAT and directory blocks written
+ * since the last commit then go through the journal as one transaction:
+ * their images are written behind the header block, then the header with
+ * a checksum over them, and only once both are on disk the blocks are
+ * written to their homes, after which the header is cleared again. A
+ * transaction with more blocks than the journal holds keeps its list of
+ * homes and its images past the end of the volume in the image file instead,
+ * which is cut back once the header is cleared.
+ * A crash thus leaves either an invalid header and homes as they were
+ * before the transaction, or a committed transaction, which replayJournal
+ * applies again when the image is next mapped or read.
+ * 
+ * Only metadata is journaled, data is ordered before it. A block newly
+ * taken by a file is free in the FAT on disk until the transaction commits,
+ * and a freed block is not taken again before its free is committed, see
+ * holdFrees, so a crash never shows a file with blocks of another file or
+ * with blocks it has not written yet. Bytes a file rewrites in blocks it
+ * already had are written in place however, and after a crash may be seen
+ * with the length and entry of the file as they were before the sync.
+ */
+
+//Blocks of a transaction kept in the journal itself.
+int journalLimit(fs_t * fs)
+{
+   int limit = fs->volume.journalBlocks - 1;
+   return (limit > journalCapacity(fs)) ? journalCapacity(fs) : limit;
+}
+
+//Read size bytes from file fd at offset into buffer.
+//returns 0 on success, -1 otherwise
+int readImage(int fd, void * buffer, size_t size, off_t offset)
+{
+   Byte * bytes = buffer;
+   while (size > 0)
+   {
+      ssize_t got = pread(fd, bytes, size, offset);
+      if (got <= 0)
+         return -1;
+      bytes += got;
+      size -= got;
+      offset += got;
+   }
+   return 0;
+}
+
+//Write size bytes from buffer to the image file at offset.
+//returns 0 on success, -1 otherwise
+int writeImage(fs_t * fs, const void * buffer, size_t size, off_t offset)
+{
+   const Byte * bytes = buffer;
+   while (size > 0)
+   {
+      ssize_t written = pwrite(fs->diskFd, bytes, size, offset);
+      if (written <= 0)
+         return -1;
+      bytes += written;
+      size -= written;
+      offset += written;
+   }
+   return 0;
+}
+
+//FNV-1a hash of size bytes, continuing from hash.
+uint32_t journalChecksum(uint32_t hash, const void * buffer, size_t size)
+{
+   const Byte * bytes = buffer;
+   for (size_t i = 0; i < size; i++)
+      hash = (hash ^ bytes[i]) * 16777619u;
+   return hash;
+}
+
+//Write count blocks, whose homes are listed in targets, through the journal to their homes.
+//returns 0 on success, -1 otherwise
+int commitTransaction(fs_t * fs, journalHeader_t * header, const uint32_t * targets, int count)
+{
+   //homes are listed in the header, or past the volume ahead of the images
+   off_t imageOffset = (off_t)(journalStart(fs) + 1) * blockSize(fs);
+   int inJournal = (count <= journalLimit(fs));
+   if (inJournal) {
+      memcpy(header->targets, targets, count * sizeof(uint32_t));
+   } else {
+      size_t targetBytes = ((count * sizeof(uint32_t) + blockSize(fs) - 1) / blockSize(fs)) * blockSize(fs);
+      if (writeImage(fs, targets, count * sizeof(uint32_t), (off_t)fs->diskSize) != 0)
+         return -1;
+      imageOffset = (off_t)(fs->diskSize + targetBytes);
+   }
+   
+   uint32_t hash = journalChecksum(2166136261u, targets, count * sizeof(uint32_t));
+   for (int i = 0; i < count; i++)
+   {
+      const diskBlock_t * image = blockAddress(fs, targets[i]);
+      hash = journalChecksum(hash, image, blockSize(fs));
+      if (writeImage(fs, image, blockSize(fs), imageOffset + (off_t)i * blockSize(fs)) != 0)
+         return -1;
+   }
+   header->magic = JOURNALMAGIC;
+   header->blockCount = count;
+   header->checksum = hash;
+   off_t headerOffset = (off_t)journalStart(fs) * blockSize(fs);
+   if ((writeImage(fs, header, blockSize(fs), headerOffset) != 0) || (fdatasync(fs->diskFd) != 0))
+      return -1;
+   
+   //the transaction is committed, its blocks can go home
+   for (int i = 0; i < count; i++)
+   {
+      if (writeImage(fs, blockAddress(fs, targets[i]), blockSize(fs), (off_t)targets[i] * blockSize(fs)) != 0)
+         return -1;
+   }
+   if (fdatasync(fs->diskFd) != 0)
+      return -1;
+   
+   //a stale transaction must not be replayed over blocks reused for data later
+   header->magic = 0;
+   if ((writeImage(fs, header, blockSize(fs), headerOffset) != 0) || (fdatasync(fs->diskFd) != 0))
+      return -1;
+   if (!inJournal && (ftruncate(fs->diskFd, (off_t)fs->diskSize) != 0))
+      logMessage(fs, FS_LOG_ERROR, "Image could not be cut back to the volume.");
+   COUNT(fs, journalCommits, 1);
+   COUNT(fs, journalBlocksWritten, count);
+   return 0;
+}
+
+//Write data blocks written since last commit to their homes, one write per
+//run of consecutive blocks. Their marks are taken into taken first and put
+//back if anything fails, so that the next commit writes them again.
+//returns 0 on success, -1 otherwise
+int commitDataBlocks(fs_t * fs, uint64_t * taken)
+{
+   for (int w = 0; w < bitmapWords(fs); w++)
+      taken[w] = __atomic_exchange_n(&fs->unsyncedBlocks[w], 0, __ATOMIC_ACQ_REL) & ~fs->metadataBlocks[w];
+   
+   int failed = 0;
+   int runStart = -1;
+   for (int i = 0; (i <= blockCount(fs)) && !failed; i++)
+   {
+      int unsynced = (i < blockCount(fs)) && ((taken[i / 64] >> (i % 64)) & 1);
+      
+      if (unsynced && (runStart == -1))
+         runStart = i;
+      
+      if (!unsynced && (runStart != -1))
+      {
+         if (writeImage(fs, blockAddress(fs, runStart), (size_t)(i - runStart) * blockSize(fs), (off_t)runStart * blockSize(fs)) != 0)
+            failed = 1;
+         runStart = -1;
+      }
+   }
+   if (failed || (fdatasync(fs->diskFd) != 0)) {
+      for (int w = 0; w < bitmapWords(fs); w++)
+         __atomic_fetch_or(&fs->unsyncedBlocks[w], taken[w], __ATOMIC_RELEASE);
+      return -1;
+   }
+   return 0;
+}
+
+/* commitDisk : makes the mapped image consistent with the volume
+ * 
+ * Writes FAT out, then every block written since last commit to the image
+ * file, through the journal if the volume has one. Caller holds the volume
+ * exclusively, so no block changes meanwhile.
+ * 
+ * returns: 0 on success, FS_FAILED if the image could not be written
+ */
+
+int commitDisk(fs_t * fs)
+{
+   copyFAT(fs);
+   if (!fs->diskIsMapped)
+      return 0;
+   if (fs->volume.journalBlocks == 0) {
+      if (syncMappedDisk(fs) != 0)
+         return fail(fs, FS_ERR_IO, "image");
+      return 0;
+   }
+   
+   uint64_t * taken = malloc(bitmapWords(fs) * sizeof(uint64_t));
+   journalHeader_t * header = calloc(1, blockSize(fs));
+   uint32_t * targets = malloc(blockCount(fs) * sizeof(uint32_t));
+   if ((taken == NULL) || (header == NULL) || (targets == NULL)) {
+      free(taken);
+      free(header);
+      free(targets);
+      return fail(fs, FS_ERR_NO_MEMORY, NULL);
+   }
+   
+   //data blocks first
+   holdWriters(fs);
+   int failed = commitDataBlocks(fs, taken);
+   releaseWriters(fs);
+   if (failed) {
+      free(taken);
+      free(header);
+      free(targets);
+      return fail(fs, FS_ERR_IO, "data blocks");
+   }
+   
+   //then metadata, all of it in one transaction
+   int count = 0;
+   for (int w = 0; w < bitmapWords(fs); w++)
+   {
+      taken[w] = __atomic_exchange_n(&fs->metadataBlocks[w], 0, __ATOMIC_ACQ_REL);
+      for (uint64_t bits = taken[w]; bits != 0; bits &= bits - 1)
+         targets[count++] = w * 64 + __builtin_ctzll(bits);
+   }
+   if (count > 0)
+      failed = commitTransaction(fs, header, targets, count);
+   
+   lockFAT(fs);
+   if (failed) {
+      //the blocks go into the next transaction; this one may still be
+      //replayed, so blocks taken since the last commit are held when freed
+      for (int w = 0; w < bitmapWords(fs); w++)
+      {
+         __atomic_fetch_or(&fs->metadataBlocks[w], taken[w], __ATOMIC_RELEASE);
+         fs->freeAtCommit[w] &= fs->freeBitmap[w];
+      }
+   } else {
+      releaseHeldBlocks(fs);
+   }
+   unlockFAT(fs);
+   free(taken);
+   free(header);
+   free(targets);
+   
+   if (failed)
+      return fail(fs, FS_ERR_IO, "journal");
+   return 0;
+}
+
+//Apply a committed transaction left in the journal by a crash.
+//The disk has just been loaded or mapped, before attachDisk.
+//returns 1 if a transaction was applied, 0 if there was none
+int replayJournal(fs_t * fs)
+{
+   if (fs->volume.journalBlocks == 0)
+      return 0;
+   
+   journalHeader_t * header = &blockAddress(fs, journalStart(fs))->journal;
+   uint32_t count = header->blockCount;
+   if ((header->magic != JOURNALMAGIC) || (count == 0) || (count > (uint32_t)blockCount(fs)))
+      return 0;
+   
+   //a transaction larger than the journal is read from past the end of the volume
+   const uint32_t * targets = header->targets;
+   Byte * images = blockAddress(fs, journalStart(fs) + 1)->data;
+   Byte * tail = NULL;
+   if (count > (uint32_t)journalLimit(fs))
+   {
+      int fd = fs->diskIsMapped ? fs->diskFd : fs->imageFd;
+      size_t targetBytes = ((count * sizeof(uint32_t) + blockSize(fs) - 1) / blockSize(fs)) * blockSize(fs);
+      tail = malloc(targetBytes + (size_t)count * blockSize(fs));
+      if ((tail == NULL) || (fd < 0)
+            || (readImage(fd, tail, targetBytes + (size_t)count * blockSize(fs), (off_t)fs->diskSize) != 0)) {
+         free(tail);
+         return 0;
+      }
+      targets = (const uint32_t *)tail;
+      images = tail + targetBytes;
+   }
+   
+   int valid = 1, applied = 0;
+   uint32_t hash = journalChecksum(2166136261u, targets, count * sizeof(uint32_t));
+   for (uint32_t i = 0; (i < count) && valid; i++)
+   {
+      uint32_t target = targets[i];
+      if ((target >= (uint32_t)blockCount(fs))
+            || ((target >= (uint32_t)journalStart(fs)) && (target < (uint32_t)(journalStart(fs) + fs->volume.journalBlocks))))
+         valid = 0;
+      hash = journalChecksum(hash, images + (size_t)i * blockSize(fs), blockSize(fs));
+   }
+   if (valid && (hash == header->checksum)) {
+      for (uint32_t i = 0; i < count; i++)
+         memmove(editMetaBlock(fs, targets[i]), images + (size_t)i * blockSize(fs), blockSize(fs));
+      //in memory only: the header on the image stays until the blocks are committed again
+      header->magic = 0;
+      logMessage(fs, FS_LOG_INFO, "Replayed %u blocks from the journal.", count);
+      applied = 1;
+   }
+   free(tail);
+   return applied;
+}
+
+//Stop using the mapped image, after flushing it.
+//Its content is carried over to the in-memory disk, even if it could not be flushed.
+//returns 0 on success, FS_FAILED if the image could not be written, or if
+//there is no memory for the in-memory disk and the image stays mapped
+int unmapDisk(fs_t * fs)
+{
+   lockVolumeExclusive(fs);
+   int result = releaseMapping(fs);
+   unlockVolume(fs);
+   return result;
+}
+
+//returns 0 on success, FS_FAILED if the image could not be written or there
+//is no memory for the in-memory disk, the image stays mapped then
+int releaseMapping(fs_t * fs)
+{
+   if (!fs->diskIsMapped)
+      return 0;
+   
+   int result = commitDisk(fs);
+   
+   Byte * mapping = fs->virtualDisk;
+   Byte * memoryDisk = realloc(fs->memoryDisk, fs->diskSize);
+   if (memoryDisk == NULL)
+      return fail(fs, FS_ERR_NO_MEMORY, NULL);
+   fs->memoryDisk = memoryDisk;
+   memmove(fs->memoryDisk, mapping, fs->diskSize);
+   munmap(mapping, fs->diskSize);
+   close(fs->diskFd);
+   
+   fs->virtualDisk = fs->memoryDisk;
+   fs->diskIsMapped = 0;
+   fs->diskFd = -1;
+   
+   //freeing blocks is no longer held back by commits
+   lockFAT(fs);
+   releaseHeldBlocks(fs);
+   unlockFAT(fs);
+   return result;
+}
+
+
+/* the basic interface to the virtual disk
+ * this moves memory around
+ */
+
+void markBlockWritten ( fs_t * fs, int block_address )
+{
+   uint64_t bit = (uint64_t)1 << (block_address % 64);
+   //usually already marked, as it is for every byte written to a block in turn
+   if (!(__atomic_load_n(&fs->unsyncedBlocks[block_address / 64], __ATOMIC_RELAXED) & bit))
+      __atomic_fetch_or(&fs->unsyncedBlocks[block_address / 64], bit, __ATOMIC_RELEASE);
+   if (!(__atomic_load_n(&fs->changedBlocks[block_address / 64], __ATOMIC_RELAXED) & bit))
+      __atomic_fetch_or(&fs->changedBlocks[block_address / 64], bit, __ATOMIC_RELEASE);
+}
+
+void writeBlock ( fs_t * fs, diskBlock_t * block, int block_address )
+{
+   memmove(blockAddress(fs, block_address)->data, block->data, blockSize(fs));
+   markBlockWritten(fs, block_address);
+}
+
+
+/* read and write FAT
+ * 
+ * please note: in memory a FAT entry is always 32-bit, on disk it is
+ *              volume.fatWidth bits wide, so a block of blockSize bytes
+ *              stores fatEntryCount entries
+ * 
+ *              how many disk blocks do we need to store the complete FAT:
+ *              - our virtual disk has blockCount blocks, each blockSize bytes long
+ *              - our FAT has blockCount entries
+ *              - we need fatBlockCount = ceil(blockCount / fatEntryCount) blocks
+ *                to store the FAT, they follow the superblock from block 1
+ */
+
+/*****
+   FUNCTIONS FOR GCS D3-D1 BELOW
+*****/
+
+
+//Write FAT blocks which changed since last call out to the virtual disk.
+//FAT is only modified in memory (see setFATEntry), this is called at sync points:
+//myfclose, mysync and writeDisk.
+void copyFAT(fs_t * fs)
+{
+   STARTTIMER(start);
+   lockFAT(fs);
+   int flushed = 0;
+   for (int i = 0; i < fatBlockCount(fs); i++)
+   {
+      if (!fs->fatBlockDirty[i])
+         continue;
+      COUNT(fs, fatBlocksFlushed, 1);
+      flushed = 1;
+      
+      diskBlock_t * block = editMetaBlock(fs, 1 + i);
+      int first = i * fatEntryCount(fs);
+      for (int j = 0; (j < fatEntryCount(fs)) && (first + j < blockCount(fs)); j++)
+      {
+         fatEntry_t value = isBlockKept(fs, first + j) ? UNUSED : fs->FAT[first + j];
+         if (fs->volume.fatWidth == 16)
+            block->fat16[j] = value;
+         else
+            block->fat32[j] = value;
+      }
+      fs->fatBlockDirty[i] = 0;
+   }
+   //free space summary goes along with the FAT it describes, where held and kept blocks are free
+   if (flushed) {
+      superBlock_t * super = &editMetaBlock(fs, 0)->super;
+      super->freeBlocks = fs->freeBlockCount + fs->heldBlockCount + fs->keptBlockCount;
+      super->nextFreeHint = fs->nextFitCursor;
+   }
+   unlockFAT(fs);
+   COUNT(fs, fatFlushes, 1);
+   STOPTIMER(fs, fatFlushTime, start);
+}
+
+//Flush pending metadata changes to the virtual disk, and commit
+//everything written since last call to a mapped image.
+//returns 0 on success, FS_FAILED if the image could not be written
+int mysync(fs_t * fs)
+{
+   lockVolumeExclusive(fs);
+   int result = commitDisk(fs);
+   unlockVolume(fs);
+   return result;
+}
+
+
+/* implement format()
+ * 
+ * in: context, geometry of the new volume or NULL for default one
+ * returns: 0 on success, FORMAT_FAILED if geometry is invalid or disk cannot be allocated
+ */
+int format(fs_t * fs, const geometry_t * geometry)
+{
+   lockVolumeExclusive(fs);
+   int result = formatDisk(fs, geometry);
+   if ((result == 0) && (commitDisk(fs) != 0))
+      result = FORMAT_FAILED;
+   unlockVolume(fs);
+   return result;
+}
+
+int formatDisk(fs_t * fs, const geometry_t * geometry)
+{
+   geometry_t defaultGeometry = { DEFAULTBLOCKCOUNT, DEFAULTBLOCKSIZE, DEFAULTFATWIDTH, DEFAULTJOURNALBLOCKS };
+   if (geometry == NULL)
+      geometry = &defaultGeometry;
+   
+   if (!isValidGeometry(geometry)) {
+      fail(fs, FS_ERR_INVALID, "geometry");
+      return FORMAT_FAILED;
+   }
+   
+   //all blocks of the new disk read as zeros
+   if ((setupVolume(fs, geometry) != 0) || (resizeDisk(fs, (size_t)blockCount(fs) * blockSize(fs), 1) != 0)) {
+      fail(fs, fs->diskIsMapped ? FS_ERR_IO : FS_ERR_NO_MEMORY, NULL);
+      return FORMAT_FAILED;
+   }
+   
+   //journal follows the FAT, then root directory
+   fs->rootDirIndex = journalStart(fs) + fs->volume.journalBlocks;
+   
+   superBlock_t * super = &editMetaBlock(fs, 0)->super;
+	strcpy(super->label, "CS3026 Operating Systems Assignment");
+   super->magic = SUPERBLOCKMAGIC;
+   super->blockCount = blockCount(fs);
+   super->blockSize = blockSize(fs);
+   super->fatWidth = fs->volume.fatWidth;
+   super->rootDirIndex = fs->rootDirIndex;
+   super->journalBlocks = fs->volume.journalBlocks;
+	
+	/* prepare FAT table
+	 * write FAT blocks to virtual disk
+	 */
+	 
+	 for (int i = 0; i < blockCount(fs); i++)
+	   fs->FAT[i] = UNUSED;
+	 
+	 fs->FAT[0] = ENDOFCHAIN;
+	 for (int i = 1; i < fatBlockCount(fs); i++)
+	   fs->FAT[i] = i + 1;
+	 fs->FAT[fatBlockCount(fs)] = ENDOFCHAIN;
+	 for (int i = journalStart(fs); i < fs->rootDirIndex - 1; i++)
+	   fs->FAT[i] = i + 1;
+	 if (fs->volume.journalBlocks > 0)
+	   fs->FAT[fs->rootDirIndex - 1] = ENDOFCHAIN;
+	 fs->FAT[fs->rootDirIndex] = ENDOFCHAIN;  
+	
+	 for (int i = 0; i < fatBlockCount(fs); i++)
+	   fs->fatBlockDirty[i] = 1;
+	 rebuildFreeBitmap(fs);
+	 copyFAT(fs);
+	 
+	 
+	//Prepare root directory
+   initDirBlock(fs, fs->rootDirIndex, 0);
+   
+   setCurrentDirToRoot(fs);
+   return 0;
+}
+
+
+/*****
+   FUNCTIONS FOR GCS C3-C1 BELOW
+*****/
+
+void loadBlock(fs_t * fs, diskBlock_t * block, int block_address)
+{
+   memmove(block->data, blockAddress(fs, block_address)->data, blockSize(fs));
+}
+
+/* borrowing blocks
+ * 
+ * Instead of copying a block, viewBlock and editBlock return a pointer into
+ * the virtual disk. A viewed block must not be modified, an edited block is
+ * marked as written straight away. The pointer stays valid until the disk is
+ * formatted, mapped, unmapped or read again.
+ */
+
+const diskBlock_t * viewBlock(fs_t * fs, int block_address)
+{
+   COUNT(fs, blockViews, 1);
+   return blockAddress(fs, block_address);
+}
+
+diskBlock_t * editBlock(fs_t * fs, int block_address)
+{
+   COUNT(fs, blockEdits, 1);
+   markBlockWritten(fs, block_address);
+   return blockAddress(fs, block_address);
+}
+
+//Edit a superblock, FAT or directory block, which commitDisk sends through the journal.
+diskBlock_t * editMetaBlock(fs_t * fs, int block_address)
+{
+   __atomic_fetch_or(&fs->metadataBlocks[block_address / 64], (uint64_t)1 << (block_address % 64), __ATOMIC_RELEASE);
+   return editBlock(fs, block_address);
+}
+
+void readFAT(fs_t * fs)
+{
+   for (int i = 0; i < fatBlockCount(fs); i++)
+   {
+      const diskBlock_t * block = viewBlock(fs, 1 + i);
+      int first = i * fatEntryCount(fs);
+      for (int j = 0; (j < fatEntryCount(fs)) && (first + j < blockCount(fs)); j++)
+      {
+         if (fs->volume.fatWidth == 16)
+            fs->FAT[first + j] = block->fat16[j];
+         else
+            fs->FAT[first + j] = block->fat32[j];
+      }
+   }
+   memset(fs->fatBlockDirty, 0x0, fatBlockCount(fs));
+   rebuildFreeBitmap(fs);
+}
+
+
+/* free space index
+ * 
+ * freeBitmap mirrors FAT: bit (i % 64) of word (i / 64) is set when FAT[i] is UNUSED.
+ * It is rebuilt whenever the FAT is loaded or formatted and updated by setFATEntry.
+ * 
+ * On a journaled image, a block which was in use at the last commit is held
+ * when it is freed: it stays out of freeBitmap, so it is neither taken nor
+ * zeroed, until commitDisk has committed the metadata which frees it. Until
+ * then, the committed directories may still lead to its old content.
+ * 
+ * Blocks cut off a file by 'w' are kept for the handle which rewrites the
+ * file over them: they stay chained and taken in memory, but copyFAT writes
+ * them as UNUSED, so that a sync or a crash while the handle is open does
+ * not leave them lost on the image. A block stops being kept as soon as its
+ * FAT entry is set again, when the handle takes it or frees it.
+ */
+
+void markBlockUsed(fs_t * fs, int index)
+{
+   uint64_t bit = (uint64_t)1 << (index % 64);
+   fs->freeBlockCount -= (fs->freeBitmap[index / 64] & bit) != 0;
+   fs->freeBitmap[index / 64] &= ~bit;
+}
+
+void markBlockFree(fs_t * fs, int index)
+{
+   uint64_t bit = (uint64_t)1 << (index % 64);
+   fs->freeBlockCount += (fs->freeBitmap[index / 64] & bit) == 0;
+   fs->freeBitmap[index / 64] |= bit;
+}
+
+int isBlockFree(fs_t * fs, int index)
+{
+   return (fs->freeBitmap[index / 64] >> (index % 64)) & 1;
+}
+
+//returns 1 if blocks freed on the volume are held until committed
+int holdFrees(fs_t * fs)
+{
+   return fs->diskIsMapped && (fs->volume.journalBlocks > 0);
+}
+
+void holdBlock(fs_t * fs, int index)
+{
+   uint64_t bit = (uint64_t)1 << (index % 64);
+   fs->heldBlockCount += (fs->heldBlocks[index / 64] & bit) == 0;
+   fs->heldBlocks[index / 64] |= bit;
+}
+
+//Keep block for a handle, see free space index. Caller holds fatLock.
+void keepBlock(fs_t * fs, int index)
+{
+   uint64_t bit = (uint64_t)1 << (index % 64);
+   fs->keptBlockCount += (fs->keptBlocks[index / 64] & bit) == 0;
+   fs->keptBlocks[index / 64] |= bit;
+   fs->fatBlockDirty[index / fatEntryCount(fs)] = 1;
+}
+
+void unkeepBlock(fs_t * fs, int index)
+{
+   uint64_t bit = (uint64_t)1 << (index % 64);
+   fs->keptBlockCount -= (fs->keptBlocks[index / 64] & bit) != 0;
+   fs->keptBlocks[index / 64] &= ~bit;
+}
+
+int isBlockKept(fs_t * fs, int index)
+{
+   return (fs->keptBlocks[index / 64] >> (index % 64)) & 1;
+}
+
+//Free blocks held until the commit which has just completed.
+//Caller holds fatLock.
+void releaseHeldBlocks(fs_t * fs)
+{
+   for (int w = 0; w < bitmapWords(fs); w++)
+   {
+      fs->freeBitmap[w] |= fs->heldBlocks[w];
+      fs->freeBlockCount += __builtin_popcountll(fs->heldBlocks[w]);
+      fs->heldBlocks[w] = 0;
+   }
+   fs->heldBlockCount = 0;
+   memcpy(fs->freeAtCommit, fs->freeBitmap, bitmapWords(fs) * sizeof(uint64_t));
+   
+   //blocks to be zeroed as they are freed were left for now, see clearChain
+   if (fs->zeroing == FS_ZERO_NOW)
+      scrubBlocks(fs, 0);
+}
+
+//Every change to FAT goes through here, so that the free space index
+//and the dirty FAT blocks are kept in sync with it.
+void setFATEntry(fs_t * fs, int index, fatEntry_t value)
+{
+   fs->FAT[index] = value;
+   fs->fatBlockDirty[index / fatEntryCount(fs)] = 1;
+   unkeepBlock(fs, index);
+   
+   if (value != UNUSED)
+      markBlockUsed(fs, index);
+   else if (holdFrees(fs) && !((fs->freeAtCommit[index / 64] >> (index % 64)) & 1))
+      holdBlock(fs, index);
+   else
+      markBlockFree(fs, index);
+   
+   //a freed block no longer belongs to a directory
+   if (value == UNUSED)
+      forgetDirBlock(fs, index);
+}
+
+void rebuildFreeBitmap(fs_t * fs)
+{
+   fs->freeBlockCount = 0;
+   
+   //a word at a time; superblock, FAT, journal and root come before rootDirIndex, they are never free
+   for (int w = 0; w < bitmapWords(fs); w++)
+   {
+      int first = (w * 64 < fs->rootDirIndex) ? fs->rootDirIndex : w * 64;
+      int end = (w * 64 + 64 < blockCount(fs)) ? w * 64 + 64 : blockCount(fs);
+      uint64_t word = 0;
+      for (int i = first; i < end; i++)
+         word |= (uint64_t)(fs->FAT[i] == UNUSED) << (i % 64);
+      fs->freeBitmap[w] = word;
+      fs->freeBlockCount += __builtin_popcountll(word);
+   }
+   fs->nextFitCursor = 0;
+   
+   //FAT was just loaded or formatted, nothing is left to commit or kept for a handle
+   memset(fs->heldBlocks, 0x0, bitmapWords(fs) * sizeof(uint64_t));
+   fs->heldBlockCount = 0;
+   memset(fs->keptBlocks, 0x0, bitmapWords(fs) * sizeof(uint64_t));
+   fs->keptBlockCount = 0;
+   memcpy(fs->freeAtCommit, fs->freeBitmap, bitmapWords(fs) * sizeof(uint64_t));
+}
+
+//Find first free block at or after nextFitCursor, wrapping around the end of the disk.
+//Whole words are skipped at a time, so the cost does not depend on how full the disk is.
+//If nothing found return NO_FREE_BLOCKS.
+int findFreeBlock(fs_t * fs)
+{
+   int word = fs->nextFitCursor / 64;
+   //ignore blocks before the cursor in the first word
+   uint64_t bits = fs->freeBitmap[word] & (~(uint64_t)0 << (fs->nextFitCursor % 64));
+   
+   COUNT(fs, freeBlockSearches, 1);
+   for (int visited = 0; visited <= bitmapWords(fs); visited++)
+   {
+      if (bits != 0)
+      {
+         int index = word * 64 + __builtin_ctzll(bits);
+         fs->nextFitCursor = (index + 1) % blockCount(fs);
+         COUNT(fs, freeBlockWordsScanned, visited + 1);
+         return index;
+      }
+      word = (word + 1) % bitmapWords(fs);
+      bits = fs->freeBitmap[word];
+   }
+   COUNT(fs, freeBlockWordsScanned, bitmapWords(fs) + 1);
+   return NO_FREE_BLOCKS;
+}
+
+//Allocation policy for growing chains: take the block physically following
+//the end of the chain if it is free, so that sequential files stay contiguous.
+int findFreeBlockAfter(fs_t * fs, int index)
+{
+   if ((index + 1 < blockCount(fs)) && isBlockFree(fs, index + 1))
+      return index + 1;
+   return findFreeBlock(fs);
+}
+
+//Find a run of count free blocks, trying the one starting at preferred first.
+//returns index of first block of the run, or NO_FREE_BLOCKS
+int findFreeRun(fs_t * fs, int preferred, int count)
+{
+   int runStart = preferred;
+   int runLength = 0;
+   
+   COUNT(fs, freeRunSearches, 1);
+   while ((runLength < count) && (runStart + runLength < blockCount(fs)) && isBlockFree(fs, runStart + runLength))
+      runLength++;
+   COUNT(fs, freeRunBlocksScanned, runLength);
+   if (runLength == count)
+      return runStart;
+   
+   runLength = 0;
+   for (int i = fs->rootDirIndex; i < blockCount(fs); i++)
+   {
+      if (!isBlockFree(fs, i)) {
+         runLength = 0;
+         continue;
+      }
+      if (runLength == 0)
+         runStart = i;
+      runLength++;
+      if (runLength == count) {
+         COUNT(fs, freeRunBlocksScanned, i - fs->rootDirIndex + 1);
+         return runStart;
+      }
+   }
+   COUNT(fs, freeRunBlocksScanned, blockCount(fs) - fs->rootDirIndex);
+   return NO_FREE_BLOCKS;
+}
+
+
+/* freeing blocks
+ * 
+ * Freed blocks need not be zeroed for the disk to work, nothing is read
+ * from a block before it is written, but a disk without leftovers of removed
+ * files is easier to inspect. Depending on fs_set_zeroing, clearChain zeroes
+ * blocks as it frees them, leaves them for scrubBlocks, run by fs_scrub and
+ * before writeDisk, or does not zero them at all.
+ */
+
+//Zero blocks first to first + count - 1 with one memset.
+void zeroBlocks(fs_t * fs, int first, int count)
+{
+   if (count == 0)
+      return;
+   
+   memset(blockRange(fs, first, count)->data, 0x0, (size_t)count * blockSize(fs));
+   for (int i = first; i < first + count; i++)
+      markBlockWritten(fs, i);
+   COUNT(fs, blocksZeroed, count);
+}
+
+//Free the chain beginning at index in one pass.
+//Caller holds fatLock.
+void clearChain(fs_t * fs, int index)
+{
+   int runStart = index, runLength = 0;
+   int blocks = 0;
+   
+   for (;;)
+   {
+      int next = fs->FAT[index];
+      setFATEntry(fs, index, UNUSED);
+      blocks++;
+      
+      //a held block is zeroed once released
+      if ((fs->zeroing == FS_ZERO_NOW) && isBlockFree(fs, index)) {
+         //zero runs of consecutive blocks at once
+         if ((runLength > 0) && (index == runStart + runLength)) {
+            runLength++;
+         } else {
+            zeroBlocks(fs, runStart, runLength);
+            runStart = index;
+            runLength = 1;
+         }
+      } else if (fs->zeroing != FS_ZERO_NEVER) {
+         fs->unscrubbedBlocks[index / 64] |= (uint64_t)1 << (index % 64);
+      }
+      
+      if (next == ENDOFCHAIN)
+         break;
+      index = next;
+   }
+   zeroBlocks(fs, runStart, runLength);
+   
+   COUNT(fs, blocksFreed, blocks);
+   COUNT(fs, chainHops, blocks - 1);
+}
+
+//Zero up to maxBlocks (all if 0) blocks freed while zeroing was deferred.
+//Blocks which were taken again since are skipped, their data is not touched,
+//held blocks are left until they are released.
+//Caller holds fatLock.
+//returns number of blocks zeroed
+int scrubBlocks(fs_t * fs, int maxBlocks)
+{
+   int zeroed = 0;
+   
+   for (int word = 0; word < bitmapWords(fs); word++)
+   {
+      if (fs->unscrubbedBlocks[word] == 0)
+         continue;
+      
+      uint64_t pending = fs->unscrubbedBlocks[word] & fs->freeBitmap[word];
+      while (pending != 0)
+      {
+         if ((maxBlocks > 0) && (zeroed == maxBlocks))
+            return zeroed;
+         
+         //zero run of consecutive pending blocks
+         int first = __builtin_ctzll(pending);
+         uint64_t run = ~(pending >> first);
+         int count = (run == 0) ? 64 : __builtin_ctzll(run);
+         if ((maxBlocks > 0) && (count > maxBlocks - zeroed))
+            count = maxBlocks - zeroed;
+         
+         zeroBlocks(fs, word * 64 + first, count);
+         uint64_t done = ((count == 64) ? ~(uint64_t)0 : (((uint64_t)1 << count) - 1)) << first;
+         pending &= ~done;
+         fs->unscrubbedBlocks[word] &= ~done;
+         zeroed += count;
+      }
+      //remaining bits belong to blocks in use again or held
+      fs->unscrubbedBlocks[word] &= fs->heldBlocks[word];
+   }
+   return zeroed;
+}
+
+//Choose whether blocks are zeroed when freed: FS_ZERO_NOW, FS_ZERO_DEFERRED
+//(default) or FS_ZERO_NEVER.
+void fs_set_zeroing(fs_t * fs, int mode)
+{
+   lockFAT(fs);
+   fs->zeroing = mode;
+   unlockFAT(fs);
+}
+
+//Number of free blocks on the volume, not counting blocks freed on a
+//journaled image since last mysync.
+int fs_free_blocks(fs_t * fs)
+{
+   lockVolume(fs);
+   lockFAT(fs);
+   int count = fs->freeBlockCount;
+   unlockFAT(fs);
+   unlockVolume(fs);
+   return count;
+}
+
+//Zero up to maxBlocks (all if 0) blocks freed while zeroing was deferred,
+//meant to be called when the context is idle or from a background thread.
+//returns number of blocks zeroed, 0 once none are left
+int fs_scrub(fs_t * fs, int maxBlocks)
+{
+   lockVolume(fs);
+   lockFAT(fs);
+   int zeroed = scrubBlocks(fs, maxBlocks);
+   unlockFAT(fs);
+   unlockVolume(fs);
+   return zeroed;
+}
+
+
+//Finds last block of a file of fileLength bytes beginning in firstBlock and
+//stores its number in the chain in blockNumber. The chain is followed only
+//as far as the length reaches, blocks a writer has chained after it do not
+//belong to the file yet.
+int getLastBlockOfFile(fs_t * fs, int firstBlock, int fileLength, int * blockNumber)
+{
+   int last = (fileLength == 0) ? 0 : (fileLength - 1) / blockSize(fs);
+   int index = firstBlock;
+   int hops = 0;
+   while ((hops < last) && (fs->FAT[index] != ENDOFCHAIN)) {
+      index = fs->FAT[index];
+      hops++;
+   }
+   COUNT(fs, chainHops, hops);
+   *blockNumber = hops;
+   return index;  
+}
+
+void setCurrentDirToRoot(fs_t * fs)
+{
+   pthread_mutex_lock(&fs->cwdLock);
+   fs->currentDirIndex = fs->rootDirIndex;
+   fs->currentDir = NULL;
+   pthread_mutex_unlock(&fs->cwdLock);
+   logMessage(fs, FS_LOG_INFO, "Current dir: root");
+}
+
+//First block of current directory of the context.
+int getCurrentDirIndex(fs_t * fs)
+{
+   pthread_mutex_lock(&fs->cwdLock);
+   int index = fs->currentDirIndex;
+   pthread_mutex_unlock(&fs->cwdLock);
+   return index;
+}
+
+
+/* directory entries
+ * 
+ * A directory is a FAT chain of directory blocks. Each block starts with a
+ * dirBlock_t header, where nextEntry is the offset at which the next entry
+ * of the block will be placed, followed by entries packed one after another.
+ * An entry takes DIRENTRYSIZE(strlen(name)) bytes and records its length in
+ * entryLength. Removed entries stay in place marked unUsed and are reused
+ * by names which fit in them.
+ * 
+ * Entries are addressed by dirEntryRef_t: block of the chain and offset in it.
+ */
+
+const dirEntry_t * viewEntry(fs_t * fs, const dirEntryRef_t * ref)
+{
+   return (const dirEntry_t *)(viewBlock(fs, ref->blockIndex)->data + ref->offset);
+}
+
+dirEntry_t * editEntry(fs_t * fs, const dirEntryRef_t * ref)
+{
+   return (dirEntry_t *)(editMetaBlock(fs, ref->blockIndex)->data + ref->offset);
+}
+
+//Start iterating over entries of directory which begins in dirBlockIndex.
+void firstDirEntry(int dirBlockIndex, dirEntryRef_t * ref)
+{
+   ref->blockIndex = dirBlockIndex;
+   ref->offset = DIRHEADERSIZE;
+}
+
+//Follows the chain if ref is past the last entry of its block.
+//returns 1 if ref points at an entry, 0 at the end of the directory
+int atDirEntry(fs_t * fs, dirEntryRef_t * ref)
+{
+   while (ref->offset >= viewBlock(fs, ref->blockIndex)->dir.nextEntry)
+   {
+      if (fs->FAT[ref->blockIndex] == ENDOFCHAIN)
+         return 0;
+      ref->blockIndex = fs->FAT[ref->blockIndex];
+      ref->offset = DIRHEADERSIZE;
+      COUNT(fs, chainHops, 1);
+   }
+   return 1;
+}
+
+void nextDirEntry(fs_t * fs, dirEntryRef_t * ref)
+{
+   ref->offset += viewEntry(fs, ref)->entryLength;
+}
+
+//Copy an entry out of the disk, it can be shorter than dirEntry_t.
+void copyDirEntry(dirEntry_t * dest, const dirEntry_t * src)
+{
+   memcpy(dest, src, src->entryLength);
+}
+
+
+/* directory blocks
+ * 
+ * dirBlocks tells blocks of directories from blocks of files, so that the
+ * I/O engine does not write over a directory and the block cache does not
+ * drop one. A block is marked as a directory takes it, under fatLock, and
+ * setFATEntry forgets a block as it is freed, but directories which were on
+ * the volume when it was attached are only found once the engine or the
+ * cache needs to know, by knowDirBlocks walking the tree.
+ * Then every directory with a marked first block was made since the volume
+ * was attached, so are all of its blocks and the directories below it.
+ */
+
+int isDirBlock(fs_t * fs, int index)
+{
+   return (__atomic_load_n(&fs->dirBlocks[index / 64], __ATOMIC_RELAXED) >> (index % 64)) & 1;
+}
+
+void markDirBlock(fs_t * fs, int index)
+{
+   __atomic_fetch_or(&fs->dirBlocks[index / 64], (uint64_t)1 << (index % 64), __ATOMIC_RELAXED);
+}
+
+void forgetDirBlock(fs_t * fs, int index)
+{
+   if (isDirBlock(fs, index))
+      __atomic_fetch_and(&fs->dirBlocks[index / 64], ~((uint64_t)1 << (index % 64)), __ATOMIC_RELAXED);
+}
+
+//Forget all directories, when a volume is attached.
+void forgetDirBlocks(fs_t * fs)
+{
+   memset(fs->dirBlocks, 0x0, bitmapWords(fs) * sizeof(uint64_t));
+   fs->dirBlocksKnown = 0;
+}
+
+//Mark blocks of directory which begins in dirBlockIndex, and of all
+//directories below it, unless it was marked already.
+//returns 0, or FS_ERR_NO_MEMORY if not all directories could be walked
+int findDirBlocks(fs_t * fs, int dirBlockIndex)
+{
+   if (isDirBlock(fs, dirBlockIndex))
+      return 0;
+   
+   int count = 0, capacity = 0;
+   fatEntry_t * subDirs = NULL;
+   int result = 0;
+   
+   lockDir(fs, dirBlockIndex);
+   for (int index = dirBlockIndex; ; index = fs->FAT[index])
+   {
+      markDirBlock(fs, index);
+      if (fs->FAT[index] == ENDOFCHAIN)
+         break;
+   }
+   dirEntryRef_t ref;
+   for (firstDirEntry(dirBlockIndex, &ref); atDirEntry(fs, &ref) && (result == 0); nextDirEntry(fs, &ref))
+   {
+      const dirEntry_t * entry = viewEntry(fs, &ref);
+      if ((entry->unUsed == 1) || !entry->isDir)
+         continue;
+      if (count == capacity) {
+         capacity = (capacity == 0) ? 16 : 2 * capacity;
+         fatEntry_t * grown = realloc(subDirs, capacity * sizeof(fatEntry_t));
+         if (grown == NULL)
+            result = FS_ERR_NO_MEMORY;
+         else
+            subDirs = grown;
+      }
+      if (result == 0)
+         subDirs[count++] = entry->firstBlock;
+   }
+   unlockDir(fs, dirBlockIndex);
+   
+   for (int i = 0; (i < count) && (result == 0); i++)
+      result = findDirBlocks(fs, subDirs[i]);
+   free(subDirs);
+   return result;
+}
+
+//Make sure every directory of the volume is in dirBlocks, walking the tree
+//the first time. Caller holds volumeLock, but no lock below it.
+//returns 0, or FS_ERR_NO_MEMORY
+int knowDirBlocks(fs_t * fs)
+{
+   if (__atomic_load_n(&fs->dirBlocksKnown, __ATOMIC_ACQUIRE))
+      return 0;
+   
+   pthread_mutex_lock(&fs->scanLock);
+   int result = 0;
+   if (!fs->dirBlocksKnown) {
+      result = findDirBlocks(fs, fs->rootDirIndex);
+      if (result == 0)
+         __atomic_store_n(&fs->dirBlocksKnown, 1, __ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&fs->scanLock);
+   return result;
+}
+
+//returns 1 if block holds data of a file: it is taken in FAT, but it is
+//neither reserved for the volume, kept for a handle nor a block of a
+//directory. Only handles and the engine write such a block.
+//Caller holds fatLock, after knowDirBlocks.
+int holdsFileData(fs_t * fs, int block)
+{
+   return (block > fs->rootDirIndex) && (fs->FAT[block] != UNUSED) && !isBlockKept(fs, block) && !isDirBlock(fs, block);
+}
+
+
+/* directory name index
+ * 
+ * Directories with at least DIRINDEXTHRESHOLD entries get an in-memory hash
+ * table from names to entries, built on a lookup which had to scan that many.
+ * Open addressing with linear probing, the name hash is kept next to each
+ * entry so that strcmp is only called on a likely match. Indexes live in
+ * DIRINDEXSLOTS slots chosen by first block of directory. New entries are
+ * added to the index, removing entries drops it.
+ */
+
+uint32_t hashName(const char * name)
+{
+   //FNV-1a
+   uint32_t hash = 2166136261u;
+   for (; *name != '\0'; name++)
+      hash = (hash ^ (Byte)*name) * 16777619u;
+   return hash;
+}
+
+void dropDirIndex(fs_t * fs, int dirBlockIndex)
+{
+   dirIndex_t * index = &fs->dirIndexes[dirBlockIndex % DIRINDEXSLOTS];
+   if (index->dirBlockIndex == dirBlockIndex)
+      index->dirBlockIndex = -1;
+}
+
+void dropAllDirIndexes(fs_t * fs)
+{
+   for (int i = 0; i < DIRINDEXSLOTS; i++)
+      fs->dirIndexes[i].dirBlockIndex = -1;
+}
+
+//returns index of directory if there is one, NULL otherwise
+dirIndex_t * findDirIndex(fs_t * fs, int dirBlockIndex)
+{
+   dirIndex_t * index = &fs->dirIndexes[dirBlockIndex % DIRINDEXSLOTS];
+   if (index->dirBlockIndex == dirBlockIndex)
+      return index;
+   return NULL;
+}
+
+void insertIntoDirIndex(dirIndex_t * index, uint32_t hash, const dirEntryRef_t * ref)
+{
+   int bucket = hash & (index->bucketCount - 1);
+   while (index->buckets[bucket].blockIndex != 0)
+      bucket = (bucket + 1) & (index->bucketCount - 1);
+   index->buckets[bucket] = *ref;
+   index->hashes[bucket] = hash;
+   index->entryCount++;
+}
+
+//Build index of directory, which has entryCount entries.
+void buildDirIndex(fs_t * fs, int dirBlockIndex, int entryCount)
+{
+   dirIndex_t * index = &fs->dirIndexes[dirBlockIndex % DIRINDEXSLOTS];
+   
+   //at most a quarter of the buckets are taken, leaving room to grow until
+   //half of them are, see addToDirIndex
+   int bucketCount = 16;
+   while (bucketCount < 4 * entryCount)
+      bucketCount *= 2;
+   
+   free(index->buckets);
+   free(index->hashes);
+   index->buckets = calloc(bucketCount, sizeof(dirEntryRef_t));
+   index->hashes = malloc(bucketCount * sizeof(uint32_t));
+   index->dirBlockIndex = -1;
+   if ((index->buckets == NULL) || (index->hashes == NULL))
+      return;
+   
+   index->bucketCount = bucketCount;
+   index->entryCount = 0;
+   
+   dirEntryRef_t ref;
+   for (firstDirEntry(dirBlockIndex, &ref); atDirEntry(fs, &ref); nextDirEntry(fs, &ref))
+   {
+      const dirEntry_t * entry = viewEntry(fs, &ref);
+      if (entry->unUsed == 0)
+         insertIntoDirIndex(index, hashName(entry->name), &ref);
+   }
+   index->dirBlockIndex = dirBlockIndex;
+}
+
+//Record new entry in index of directory, if it has one.
+void addToDirIndex(fs_t * fs, int dirBlockIndex, const char * filename, const dirEntryRef_t * ref)
+{
+   dirIndex_t * index = findDirIndex(fs, dirBlockIndex);
+   if (index == NULL)
+      return;
+   
+   //a full index is rebuilt on next lookup
+   if (2 * (index->entryCount + 1) > index->bucketCount)
+      dropDirIndex(fs, dirBlockIndex);
+   else
+      insertIntoDirIndex(index, hashName(filename), ref);
+}
+
+//Look for used entry named filename in directory which begins in dirBlockIndex.
+//return 0 and set ref, if found
+//return FILE_NOT_FOUND otherwise
+int findEntryByName(fs_t * fs, int dirBlockIndex, const char * filename, dirEntryRef_t * ref)
+{
+   dirIndex_t * index = findDirIndex(fs, dirBlockIndex);
+   
+   if (index != NULL)
+   {
+      COUNT(fs, dirIndexHits, 1);
+      uint32_t hash = hashName(filename);
+      int bucket = hash & (index->bucketCount - 1);
+      
+      for (; index->buckets[bucket].blockIndex != 0; bucket = (bucket + 1) & (index->bucketCount - 1))
+      {
+         const dirEntry_t * entry = viewEntry(fs, &index->buckets[bucket]);
+         if ((index->hashes[bucket] == hash) && (entry->unUsed == 0) && (strcmp(entry->name, filename) == 0))
+         {
+            *ref = index->buckets[bucket];
+            return 0;
+         }
+      }
+      return FILE_NOT_FOUND;
+   }
+   
+   //iterate over entries, counting them to know if the directory should be indexed
+   COUNT(fs, dirScans, 1);
+   int entryCount = 0;
+   dirEntryRef_t current;
+   for (firstDirEntry(dirBlockIndex, &current); atDirEntry(fs, &current); nextDirEntry(fs, &current))
+   {
+      const dirEntry_t * entry = viewEntry(fs, &current);
+      entryCount++;
+      
+      //compare filename from the entry to the one provided
+      if ((entry->unUsed == 0) && (strcmp(entry->name, filename) == 0))
+      {
+         *ref = current;
+         return 0;
+      }
+   }
+   
+   if (entryCount >= DIRINDEXTHRESHOLD)
+      buildDirIndex(fs, dirBlockIndex, entryCount);
+   return FILE_NOT_FOUND;
+}
+
+/* dentry cache
+ * 
+ * Path resolution looks every component up in its directory. The entries
+ * found last are kept in DENTRYCACHESIZE slots, chained by hash of directory
+ * and name and ordered by use, so that paths which are opened again resolve
+ * without touching directory blocks. The least recently used slot is reused
+ * once all are taken. Only found entries are cached, so creating an entry
+ * needs no invalidation, removing or replacing one drops its slot.
+ */
+
+void dropAllDentries(fs_t * fs)
+{
+   pthread_mutex_lock(&fs->dentryLock);
+   for (int i = 0; i < DENTRYCACHESIZE; i++)
+   {
+      fs->dentryCache[i].dirBlockIndex = -1;
+      fs->dentryCache[i].lruPrev = i - 1;
+      fs->dentryCache[i].lruNext = (i + 1 < DENTRYCACHESIZE) ? i + 1 : -1;
+      fs->dentryBuckets[i] = -1;
+   }
+   fs->lruFirst = 0;
+   fs->lruLast = DENTRYCACHESIZE - 1;
+   pthread_mutex_unlock(&fs->dentryLock);
+}
+
+uint32_t hashDentry(int dirBlockIndex, const char * name)
+{
+   return hashName(name) ^ ((uint32_t)dirBlockIndex * 2654435761u);
+}
+
+void unlinkFromLRU(fs_t * fs, int slot)
+{
+   dentry_t * dentry = &fs->dentryCache[slot];
+   if (dentry->lruPrev == -1)
+      fs->lruFirst = dentry->lruNext;
+   else
+      fs->dentryCache[dentry->lruPrev].lruNext = dentry->lruNext;
+   if (dentry->lruNext == -1)
+      fs->lruLast = dentry->lruPrev;
+   else
+      fs->dentryCache[dentry->lruNext].lruPrev = dentry->lruPrev;
+}
+
+//Move slot to the front (most recently used) or back (reused first) of LRU order.
+void moveInLRU(fs_t * fs, int slot, int toFront)
+{
+   dentry_t * dentry = &fs->dentryCache[slot];
+   unlinkFromLRU(fs, slot);
+   if (toFront) {
+      dentry->lruPrev = -1;
+      dentry->lruNext = fs->lruFirst;
+      if (fs->lruFirst == -1)
+         fs->lruLast = slot;
+      else
+         fs->dentryCache[fs->lruFirst].lruPrev = slot;
+      fs->lruFirst = slot;
+   } else {
+      dentry->lruNext = -1;
+      dentry->lruPrev = fs->lruLast;
+      if (fs->lruLast == -1)
+         fs->lruFirst = slot;
+      else
+         fs->dentryCache[fs->lruLast].lruNext = slot;
+      fs->lruLast = slot;
+   }
+}
+
+//Take slot out of its hash chain and make it the next one to be reused.
+void freeDentry(fs_t * fs, int slot)
+{
+   dentry_t * dentry = &fs->dentryCache[slot];
+   if (dentry->dirBlockIndex == -1)
+      return;
+   
+   int * link = &fs->dentryBuckets[dentry->hash & (DENTRYCACHESIZE - 1)];
+   while (*link != slot)
+      link = &fs->dentryCache[*link].hashNext;
+   *link = dentry->hashNext;
+   
+   dentry->dirBlockIndex = -1;
+   moveInLRU(fs, slot, 0);
+}
+
+int findDentry(fs_t * fs, int dirBlockIndex, const char * name, uint32_t hash)
+{
+   for (int slot = fs->dentryBuckets[hash & (DENTRYCACHESIZE - 1)]; slot != -1; slot = fs->dentryCache[slot].hashNext)
+   {
+      const dentry_t * dentry = &fs->dentryCache[slot];
+      if ((dentry->hash == hash) && (dentry->dirBlockIndex == dirBlockIndex) && (strcmp(dentry->name, name) == 0))
+         return slot;
+   }
+   return -1;
+}
+
+//Forget entry named name in directory which begins in dirBlockIndex.
+void dropDentry(fs_t * fs, int dirBlockIndex, const char * name)
+{
+   pthread_mutex_lock(&fs->dentryLock);
+   int slot = findDentry(fs, dirBlockIndex, name, hashDentry(dirBlockIndex, name));
+   if (slot != -1)
+      freeDentry(fs, slot);
+   pthread_mutex_unlock(&fs->dentryLock);
+}
+
+//Forget all entries of directory which begins in dirBlockIndex.
+void dropDentriesOfDir(fs_t * fs, int dirBlockIndex)
+{
+   pthread_mutex_lock(&fs->dentryLock);
+   for (int i = 0; i < DENTRYCACHESIZE; i++)
+   {
+      if (fs->dentryCache[i].dirBlockIndex == dirBlockIndex)
+         freeDentry(fs, i);
+   }
+   pthread_mutex_unlock(&fs->dentryLock);
+}
+
+//Look for used entry named name in directory which begins in dirBlockIndex,
+//in the cache first and in the directory if it is not there.
+//Caller holds lock of the directory.
+//return 0 and set ref and firstBlock if found, FILE_NOT_FOUND otherwise
+int lookupDentry(fs_t * fs, int dirBlockIndex, const char * name, dirEntryRef_t * ref, fatEntry_t * firstBlock)
+{
+   uint32_t hash = hashDentry(dirBlockIndex, name);
+   
+   pthread_mutex_lock(&fs->dentryLock);
+   int slot = findDentry(fs, dirBlockIndex, name, hash);
+   COUNT(fs, pathComponents, 1);
+   
+   if (slot == -1)
+   {
+      COUNT(fs, dentryMisses, 1);
+      //directory is searched without dentryLock, it cannot change meanwhile
+      pthread_mutex_unlock(&fs->dentryLock);
+      dirEntryRef_t found;
+      if (findEntryByName(fs, dirBlockIndex, name, &found) == FILE_NOT_FOUND)
+         return FILE_NOT_FOUND;
+      pthread_mutex_lock(&fs->dentryLock);
+      
+      //reuse least recently used slot
+      slot = fs->lruLast;
+      freeDentry(fs, slot);
+      
+      dentry_t * dentry = &fs->dentryCache[slot];
+      const dirEntry_t * entry = viewEntry(fs, &found);
+      dentry->dirBlockIndex = dirBlockIndex;
+      dentry->hash = hash;
+      strcpy(dentry->name, name);
+      dentry->entryRef = found;
+      dentry->firstBlock = entry->firstBlock;
+      dentry->isDir = entry->isDir;
+      
+      int * bucket = &fs->dentryBuckets[hash & (DENTRYCACHESIZE - 1)];
+      dentry->hashNext = *bucket;
+      *bucket = slot;
+   } else {
+      COUNT(fs, dentryHits, 1);
+   }
+   
+   moveInLRU(fs, slot, 1);
+   *ref = fs->dentryCache[slot].entryRef;
+   *firstBlock = fs->dentryCache[slot].firstBlock;
+   pthread_mutex_unlock(&fs->dentryLock);
+   return 0;
+}
+
+//Check if input for fopen is correct, details being resolved path of the file
+int validateInputForFOpen(fs_t * fs, const folderAndEntry * details, const char mode, dirEntryRef_t * ref)
+//return 0 and set ref to entry of file, if found
+//return FILE_NOT_FOUND_IN_W_OR_A_MODE, if file not found but mode is write or append
+//return VALIDATION_FAILED otherwise, with the reason recorded
+{
+   //Check input mode
+   if ((mode != 'r') && (mode != 'w') && (mode != 'a')) {
+      fail(fs, FS_ERR_INVALID, "mode");
+      return VALIDATION_FAILED;
+   }
+   
+   //If file not found and in reading mode
+   if ((details->entryFound == 0) && (mode == 'r')) {
+      fail(fs, FS_ERR_NOT_FOUND, details->entryName);
+      return VALIDATION_FAILED;
+   }
+   
+   //If file not found but mode is append or write
+   if (details->entryFound == 0)
+      return FILE_NOT_FOUND_IN_W_OR_A_MODE;
+   
+   //If file found, but is a directory
+   *ref = details->entryRef;
+   if (viewEntry(fs, ref)->isDir) {
+      fail(fs, FS_ERR_IS_DIR, details->entryName);
+      return VALIDATION_FAILED;
+   }
+      
+   return 0;
+}
+
+void fillDirEntry(dirEntry_t * dirEntry_ptr, const char * filename, int isDir, int firstBlock)
+{
+   dirEntry_ptr->isDir = isDir;
+   dirEntry_ptr->unUsed = 0;
+   dirEntry_ptr->modTime = time(NULL);
+   dirEntry_ptr->fileLength = 0;
+   dirEntry_ptr->firstBlock = firstBlock;
+   strcpy(dirEntry_ptr -> name, filename);
+}
+
+//Prepare an empty directory block.
+void initDirBlock(fs_t * fs, int blockIndex, int parentBlockIndex)
+{
+   dirBlock_t * dir = &editMetaBlock(fs, blockIndex)->dir;
+   markDirBlock(fs, blockIndex);
+   memset(dir, 0x0, blockSize(fs));
+   dir->isDir = 1;
+   dir->parentBlockIndex = parentBlockIndex;
+   dir->nextEntry = DIRHEADERSIZE;
+}
+
+//Create entry named filename, with a first block of its own, in directory
+//which begins in directoryBlockIndex. The directory grows by a block if its
+//last block has no room and no unused entry is long enough.
+//Caller holds lock of the directory.
+//return 0 and set ref (unless NULL) to the new entry
+//return ALLOCATION_FAILED if name is too long or disk is full
+int allocateNewEntry(fs_t * fs, int directoryBlockIndex, const char * filename, int isDir, dirEntryRef_t * ref)
+{
+   //Filename length checker
+   if (!(strlen(filename) < MAXNAME))
+      return ALLOCATION_FAILED;
+   
+   int size = DIRENTRYSIZE(strlen(filename));
+   
+   //look for an unused entry which is long enough, remembering the last block
+   dirEntryRef_t slot;
+   int found = 0;
+   for (firstDirEntry(directoryBlockIndex, &slot); atDirEntry(fs, &slot); nextDirEntry(fs, &slot))
+   {
+      const dirEntry_t * entry = viewEntry(fs, &slot);
+      if ((entry->unUsed == 1) && (entry->entryLength >= size))
+      {
+         found = 1;
+         break;
+      }
+   }
+   //at the end of directory slot points past the last entry of its last block
+   int lastDirBlock = slot.blockIndex;
+   
+   //Find free block to allocate file and update FAT table
+   lockFAT(fs);
+   int index = findFreeBlock(fs);
+   if (index != NO_FREE_BLOCKS) {
+      setFATEntry(fs, index, ENDOFCHAIN);
+      if (isDir == 1)
+         markDirBlock(fs, index);
+   }
+   unlockFAT(fs);
+   
+   // If any free block was found, its index was returned
+   // If not, NO_FREE_BLOCKS was returned and func cannot proceed
+   if (index == NO_FREE_BLOCKS)
+      return ALLOCATION_FAILED;
+   
+   int entryLength = size;
+   if (found) {
+      //reused entry keeps its length
+      entryLength = viewEntry(fs, &slot)->entryLength;
+   } else if (viewBlock(fs, lastDirBlock)->dir.nextEntry + size <= blockSize(fs)) {
+      //append to last block
+      slot.offset = viewBlock(fs, lastDirBlock)->dir.nextEntry;
+      editMetaBlock(fs, lastDirBlock)->dir.nextEntry += size;
+   } else {
+      //extend directory by one block
+      lockFAT(fs);
+      int newDirBlock = findFreeBlockAfter(fs, lastDirBlock);
+      if (newDirBlock == NO_FREE_BLOCKS) {
+         setFATEntry(fs, index, UNUSED);
+      } else {
+         setFATEntry(fs, newDirBlock, ENDOFCHAIN);
+         setFATEntry(fs, lastDirBlock, newDirBlock);
+         markDirBlock(fs, newDirBlock);
+      }
+      unlockFAT(fs);
+      if (newDirBlock == NO_FREE_BLOCKS)
+         return ALLOCATION_FAILED;
+      initDirBlock(fs, newDirBlock, viewBlock(fs, directoryBlockIndex)->dir.parentBlockIndex);
+      
+      slot.blockIndex = newDirBlock;
+      slot.offset = DIRHEADERSIZE;
+      editMetaBlock(fs, newDirBlock)->dir.nextEntry += size;
+   }
+   
+   //UPDATING dirEntry below, in place
+   dirEntry_t * entry = editEntry(fs, &slot);
+   entry->entryLength = entryLength;
+   fillDirEntry(entry, filename, isDir, index);
+   
+   //index of a removed directory was dropped by myrmdir,
+   //so a directory block which is reused starts without one
+   addToDirIndex(fs, directoryBlockIndex, filename, &slot);
+   
+   //if dir then initial structure has to be set 
+   if (isDir == 1)
+      initDirBlock(fs, index, directoryBlockIndex);
+   
+   if (ref != NULL)
+      *ref = slot;
+   return 0;
+}
+
+
+
+
+MyFILE * myfopen(fs_t * fs, const char * path, const char mode)
+{
+   lockVolume(fs);
+   folderAndEntry details = getDetailsFromPath(fs, path);
+   
+   //reason was recorded when the path was resolved
+   if (details.pathToFolderFound == 0) {
+      unlockVolume(fs);
+      return NULL;
+   }
+   
+   const char * filename = details.entryName;
+   
+   int blockIndex = details.folderFirstBlock;
+   
+   //entry is looked up again, as it may have changed since path was resolved
+   lockDir(fs, blockIndex);
+   findEntryOfDetails(fs, &details);
+   
+   dirEntryRef_t entryRef;
+   fatEntry_t spareNext = ENDOFCHAIN;
+   int spareCount = 0;
+   int result = validateInputForFOpen(fs, &details, mode, &entryRef);
+   
+   if (result == VALIDATION_FAILED) {
+      unlockDir(fs, blockIndex);
+      unlockVolume(fs);
+      return NULL;
+   }
+      
+   //if validation returned file not found in write or append mode
+   //create file and store its entry in entryRef
+   if (result == FILE_NOT_FOUND_IN_W_OR_A_MODE)
+   {
+      if (allocateNewEntry(fs, blockIndex, filename, 0, &entryRef) == ALLOCATION_FAILED)
+      {
+         unlockDir(fs, blockIndex);
+         unlockVolume(fs);
+         fail(fs, FS_ERR_NO_SPACE, filename);
+         return NULL;
+      }
+   } else if (mode == 'w') {
+      //if file found but in write mode it is truncated in place: entry and
+      //first block are kept, the rest of the chain is cut off and kept by
+      //the handle, which rewrites the file over those blocks in order;
+      //whatever is left of them is freed by myfclose. Meanwhile they are
+      //free in the FAT on disk, see keepBlock
+      dirEntry_t * entry = editEntry(fs, &entryRef);
+      entry->fileLength = 0;
+      entry->modTime = time(NULL);
+      
+      lockFAT(fs);
+      spareNext = fs->FAT[entry->firstBlock];
+      if (spareNext != ENDOFCHAIN) {
+         setFATEntry(fs, entry->firstBlock, ENDOFCHAIN);
+         for (int index = spareNext; index != ENDOFCHAIN; index = fs->FAT[index])
+         {
+            keepBlock(fs, index);
+            spareCount++;
+         }
+         COUNT(fs, chainHops, spareCount);
+      }
+      unlockFAT(fs);
+   }
+   
+   
+   
+   const dirEntry_t * entry = viewEntry(fs, &entryRef);
+   
+   //Creating filedescriptor structure
+   //a truncated file ends in its first block, see moveToNextBlock
+   MyFILE * newFile = malloc(sizeof(MyFILE)); //dynamically cause scope independence
+   if (newFile == NULL) {
+      unlockDir(fs, blockIndex);
+      unlockVolume(fs);
+      fail(fs, FS_ERR_NO_MEMORY, NULL);
+      return NULL;
+   }
+   newFile->fs = fs;
+   newFile->mode = mode;
+   newFile->fileLength = entry->fileLength;
+   int lastBlockNumber;
+   newFile->lastBlockIndex = getLastBlockOfFile(fs, entry->firstBlock, entry->fileLength, &lastBlockNumber);
+   newFile->dirBlockIndex = blockIndex;
+   newFile->entryRef = entryRef;
+   newFile->reservedNext = 0;
+   newFile->reservedCount = 0;
+   newFile->spareNext = spareNext;
+   newFile->spareCount = spareCount;
+   newFile->chain = NULL;
+   newFile->chainLength = 0;
+   newFile->chainCapacity = 0;
+   newFile->sequentialBlocks = 0;
+   newFile->readaheadEnd = 0;
+   
+   //If append mode, pos, currBlock
+   if (mode == 'a') {
+      newFile->currBlockNumber = lastBlockNumber;
+      newFile->pos = bytesInLastBlock(fs, newFile->fileLength);
+         //get position in last file
+      newFile->currBlockIndex = newFile->lastBlockIndex;
+   } else {
+      newFile->pos = 0;
+      newFile->currBlockIndex = entry->firstBlock;
+      newFile->currBlockNumber = 0;
+   }
+   unlockDir(fs, blockIndex);
+   //allocation based on currBlockIndex set above
+   
+   //borrowing current block
+   borrowBlock(newFile);
+   if ((mode == 'w') || (mode == 'a'))
+      addWriter(newFile);
+   unlockVolume(fs);
+   
+   //return handle to the structure
+   return newFile;
+}
+
+//Give back blocks reserved by myfallocate which the file did not grow into.
+void releaseReservation(MyFILE * stream)
+{
+   fs_t * fs = stream->fs;
+   if (stream->reservedCount == 0)
+      return;
+   
+   lockFAT(fs);
+   for (int i = 0; i < stream->reservedCount; i++)
+      setFATEntry(fs, stream->reservedNext + i, UNUSED);
+   unlockFAT(fs);
+   stream->reservedCount = 0;
+}
+
+//Free blocks of the old chain of a file truncated by 'w' which the file was
+//not rewritten over. They are still chained to each other.
+void releaseSpare(MyFILE * stream)
+{
+   fs_t * fs = stream->fs;
+   if (stream->spareCount == 0)
+      return;
+   
+   lockFAT(fs);
+   clearChain(fs, stream->spareNext);
+   unlockFAT(fs);
+   stream->spareCount = 0;
+}
+
+//Reserve a contiguous run of blocks, directly following the end of the chain
+//if possible, into which the file will grow until it is size bytes long.
+//Reserved blocks are taken in FAT at once but only linked into the chain
+//when written to; whatever is left is released by myfclose.
+//If no run is long enough, the longest run found by halving is reserved.
+//returns number of blocks reserved
+int myfallocate(MyFILE * stream, int size)
+{
+   fs_t * fs = stream->fs;
+   if (stream->mode == 'r')
+      return 0;
+   
+   //blocks in chain: ceil(fileLength / blockSize), but never less than one,
+   //and blocks of the old chain the file will be rewritten over first
+   int blocksInChain = (stream->fileLength + blockSize(fs) - 1) / blockSize(fs);
+   if (blocksInChain == 0)
+      blocksInChain = 1;
+   
+   int needed = (size + blockSize(fs) - 1) / blockSize(fs) - blocksInChain - stream->spareCount;
+   
+   lockVolume(fs);
+   releaseReservation(stream);
+   
+   lockFAT(fs);
+   int runStart = NO_FREE_BLOCKS;
+   while ((needed > 0) && (runStart == NO_FREE_BLOCKS))
+   {
+      runStart = findFreeRun(fs, stream->lastBlockIndex + 1, needed);
+      if (runStart == NO_FREE_BLOCKS)
+         needed /= 2;
+   }
+   if (runStart != NO_FREE_BLOCKS) {
+      for (int i = runStart; i < runStart + needed; i++)
+         setFATEntry(fs, i, ENDOFCHAIN);
+   }
+   unlockFAT(fs);
+   unlockVolume(fs);
+   
+   if (runStart == NO_FREE_BLOCKS)
+      return 0;
+   
+   stream->reservedNext = runStart;
+   stream->reservedCount = needed;
+   return needed;
+}
+
+//Free blocks chained after the last block of the file, which myftruncate
+//cut off. Caller holds volumeLock.
+void freeTail(MyFILE * stream)
+{
+   fs_t * fs = stream->fs;
+   
+   lockFAT(fs);
+   fatEntry_t tail = fs->FAT[stream->lastBlockIndex];
+   if (tail != ENDOFCHAIN) {
+      setFATEntry(fs, stream->lastBlockIndex, ENDOFCHAIN);
+      clearChain(fs, tail);
+   }
+   unlockFAT(fs);
+}
+
+void myfclose(MyFILE	* stream)
+{
+   fs_t * fs = stream->fs;
+   lockVolume(fs);
+   releaseReservation(stream);
+   releaseSpare(stream);
+   
+   if ((stream->mode == 'w') || (stream->mode == 'a'))
+   {
+      dropWriter(stream);
+      //updating file length in dirEntry
+      lockDir(fs, stream->dirBlockIndex);
+      editEntry(fs, &stream->entryRef)->fileLength = stream->fileLength;
+      unlockDir(fs, stream->dirBlockIndex);
+   }
+   
+   copyFAT(fs);
+   unlockVolume(fs);
+   
+   //free the dynamically allocated memory 
+   free(stream->chain);
+   free(stream);
+}
+
+
+/* block access of file handles
+ * 
+ * A handle works on its current block in place, so handles of a file share
+ * its data and nothing is copied when a handle moves between blocks. Blocks
+ * are borrowed for writing by handles which may write, which are kept in a
+ * list of writers of the context. Writes do not mark blocks themselves:
+ * whenever marks of written blocks are taken, writers are held out of their
+ * blocks until these are flushed, and the block every writer is inside is
+ * then marked written again, so it is flushed by the next sync.
+ * 
+ * Blocks of a mapped image are read from the page cache, which faults them
+ * in one page at a time, and blocks of an image read by readDisk are loaded
+ * from it a group at a time as they are first used. Once a handle has
+ * entered two blocks in chain order, the kernel is told a window of
+ * readaheadBlocks blocks following the current one will be needed, in one
+ * call per run of consecutive blocks, and the window is moved on when the
+ * handle is half way through it. How much of a mapped image stays resident
+ * is bounded by the block cache.
+ */
+
+void borrowBlock(MyFILE * stream)
+{
+   fs_t * fs = stream->fs;
+   if (stream->mode == 'r') {
+      stream->buffer = blockAddress(fs, stream->currBlockIndex);
+      COUNT(fs, blockViews, 1);
+   } else {
+      stream->buffer = editBlock(fs, stream->currBlockIndex);
+   }
+   cacheBlock(fs, stream->currBlockIndex);
+}
+
+//Register a handle which may write, it is unregistered by dropWriter.
+void addWriter(MyFILE * stream)
+{
+   fs_t * fs = stream->fs;
+   pthread_mutex_init(&stream->writeLock, NULL);
+   pthread_mutex_lock(&fs->writerLock);
+   stream->prevWriter = NULL;
+   stream->nextWriter = fs->writers;
+   if (fs->writers != NULL)
+      fs->writers->prevWriter = stream;
+   fs->writers = stream;
+   pthread_mutex_unlock(&fs->writerLock);
+}
+
+void dropWriter(MyFILE * stream)
+{
+   fs_t * fs = stream->fs;
+   pthread_mutex_lock(&fs->writerLock);
+   if (stream->prevWriter != NULL)
+      stream->prevWriter->nextWriter = stream->nextWriter;
+   else
+      fs->writers = stream->nextWriter;
+   if (stream->nextWriter != NULL)
+      stream->nextWriter->prevWriter = stream->prevWriter;
+   pthread_mutex_unlock(&fs->writerLock);
+   pthread_mutex_destroy(&stream->writeLock);
+}
+
+//Stop every writer from writing into its current block, before marks of
+//written blocks are taken and the blocks are flushed, until releaseWriters.
+//Caller holds volumeLock exclusive, so no handle moves to another block.
+void holdWriters(fs_t * fs)
+{
+   pthread_mutex_lock(&fs->writerLock);
+   for (MyFILE * stream = fs->writers; stream != NULL; stream = stream->nextWriter)
+      pthread_mutex_lock(&stream->writeLock);
+}
+
+//Let writers go on after holdWriters. Handles write into their current
+//block in place without marking it, so it is marked written again for the
+//bytes they write after the flush.
+void releaseWriters(fs_t * fs)
+{
+   for (MyFILE * stream = fs->writers; stream != NULL; stream = stream->nextWriter)
+   {
+      markBlockWritten(fs, stream->currBlockIndex);
+      pthread_mutex_unlock(&stream->writeLock);
+   }
+   pthread_mutex_unlock(&fs->writerLock);
+}
+
+//Advise blocks first to first + count - 1 of a mapped image, or of the image
+//an in-memory disk is loaded from, will be read soon.
+void adviseBlocks(fs_t * fs, int first, int count)
+{
+   if (count == 0)
+      return;
+   if (!fs->diskIsMapped) {
+      //groups loaded already are not read again
+      int firstGroup = first / LAZYGROUPBLOCKS, lastGroup = (first + count - 1) / LAZYGROUPBLOCKS;
+      if (!((__atomic_load_n(&fs->loadedGroups[firstGroup / 64], __ATOMIC_ACQUIRE) >> (firstGroup % 64)) & 1)
+            || !((__atomic_load_n(&fs->loadedGroups[lastGroup / 64], __ATOMIC_ACQUIRE) >> (lastGroup % 64)) & 1))
+         posix_fadvise(fs->imageFd, (off_t)first * blockSize(fs), (off_t)count * blockSize(fs), POSIX_FADV_WILLNEED);
+      return;
+   }
    
-   //Creating filedescriptor structure
-   MyFILE * newFile = malloc(sizeof(MyFILE)); //dynamically cause scope independence
-   newFile->mode = mode;
-   newFile->fileLength = currDirBlock.dir.entryList[entryIndex].fileLength;
-   newFile->lastBlockIndex = getEndOfChainIndex(currDirBlock.dir.entryList[entryIndex].firstBlock);
-   newFile->parentBlockIndex = blockIndex;
-   newFile->parentEntrylistIndex = entryIndex;
+   uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+   uintptr_t start = (uintptr_t)blockAddress(fs, first) & ~(pageSize - 1);
+   uintptr_t end = (uintptr_t)blockAddress(fs, first + count - 1) + blockSize(fs);
+   posix_madvise((void *)start, end - start, POSIX_MADV_WILLNEED);
+}
+
+void readAhead(MyFILE * stream)
+{
+   fs_t * fs = stream->fs;
    
-   //If append mode, pos, currBlock
-   if (mode == 'a') {
-      newFile->pos = newFile->fileLength - (countBlocksInChain(currDirBlock.dir.entryList[entryIndex].firstBlock) - 1) * BLOCKSIZE; 
-         //get position in last file
-      newFile->currBlockIndex = newFile->lastBlockIndex;
+   if ((!fs->diskIsMapped && (fs->imageFd < 0)) || (fs->readaheadBlocks == 0) || (stream->sequentialBlocks < 2))
+      return;
+   if (stream->currBlockNumber + fs->readaheadBlocks / 2 < stream->readaheadEnd)
+      return;
+   
+   //walk the window, skipping blocks advised before
+   int block = stream->currBlockIndex;
+   int number = stream->currBlockNumber;
+   int end = number + fs->readaheadBlocks;
+   int runStart = 0, runLength = 0;
+   
+   while ((number < end) && (block != stream->lastBlockIndex))
+   {
+      block = fs->FAT[block];
+      number++;
+      if (number <= stream->readaheadEnd)
+         continue;
+      
+      if ((runLength > 0) && (block == runStart + runLength)) {
+         runLength++;
+      } else {
+         adviseBlocks(fs, runStart, runLength);
+         runStart = block;
+         runLength = 1;
+      }
+   }
+   adviseBlocks(fs, runStart, runLength);
+   COUNT(fs, chainHops, number - stream->currBlockNumber);
+   stream->readaheadEnd = number;
+}
+
+//Set size of readahead window of handles on mapped images, 0 turns readahead off.
+void fs_set_readahead(fs_t * fs, int blocks)
+{
+   fs->readaheadBlocks = (blocks > 0) ? blocks : 0;
+}
+
+
+/* block cache
+ * 
+ * Pages of a mapped image stay resident once handles have used them, and a
+ * journaled image is mapped privately, so every page written keeps a copy
+ * of its own. The block cache bounds the part of the mapping handles keep
+ * resident to cacheBlocks blocks. It works in lines of one page, or of one
+ * block if blocks are larger, as the kernel drops no less.
+ * 
+ * Every block a handle borrows puts its line in the cache, or sets the
+ * line's reference bit if it is there already. Once the cache is full, a
+ * new line replaces the first line the hand comes to, going round the ring
+ * in CLOCK order, whose bit is clear, clearing bits as it passes them. The
+ * line is written back if one of its blocks was written since the last sync,
+ * to the image file for a private mapping, by msync otherwise, and dropped
+ * with madvise. Its blocks stay marked for the next sync, which writes them
+ * again. Only lines whose blocks all hold file data are dropped, other lines
+ * are passed over like lines with their bit set.
+ * 
+ * A line is dropped under fatLock, writerLock and the writeLock of every
+ * writer, so no handle and no request of the engine writes into it meanwhile.
+ */
+
+//Size the cache for the volume and empty it.
+//returns 0 on success, -1 if it cannot be allocated
+int setupCache(fs_t * fs)
+{
+   long pageSize = sysconf(_SC_PAGESIZE);
+   fs->cacheLineBlocks = (pageSize > blockSize(fs)) ? (int)(pageSize / blockSize(fs)) : 1;
+   int lines = (blockCount(fs) + fs->cacheLineBlocks - 1) / fs->cacheLineBlocks;
+   int capacity = fs->cacheBlocks / fs->cacheLineBlocks;
+   if ((fs->cacheBlocks > 0) && (capacity == 0))
+      capacity = 1;
+   
+   fs->cacheCapacity = 0;
+   fs->cacheUsed = 0;
+   fs->cacheHand = 0;
+   //a cache which holds every line never drops one
+   if ((capacity == 0) || (capacity >= lines))
+      return 0;
+   
+   int words = (lines + 63) / 64;
+   int * ring = realloc(fs->cacheRing, capacity * sizeof(int));
+   if (ring == NULL)
+      return -1;
+   fs->cacheRing = ring;
+   uint64_t * cached = realloc(fs->cachedLines, words * sizeof(uint64_t));
+   if (cached == NULL)
+      return -1;
+   fs->cachedLines = cached;
+   uint64_t * referenced = realloc(fs->referencedLines, words * sizeof(uint64_t));
+   if (referenced == NULL)
+      return -1;
+   fs->referencedLines = referenced;
+   
+   memset(fs->cachedLines, 0x0, words * sizeof(uint64_t));
+   memset(fs->referencedLines, 0x0, words * sizeof(uint64_t));
+   fs->cacheCapacity = capacity;
+   return 0;
+}
+
+//Set how many blocks of a mapped image handles keep resident, 0 leaves it
+//to the kernel. The cache starts empty.
+//returns 0 on success, FS_FAILED if there is no memory for it
+int fs_set_cache(fs_t * fs, int blocks)
+{
+   lockVolumeExclusive(fs);
+   fs->cacheBlocks = (blocks > 0) ? blocks : 0;
+   int result = 0;
+   if ((fs->FAT != NULL) && (setupCache(fs) != 0))
+      result = FS_ERR_NO_MEMORY;
+   unlockVolume(fs);
+   
+   if (result != 0)
+      return fail(fs, result, NULL);
+   return 0;
+}
+
+//Write line back if it was written, and drop it from the mapping.
+//Caller holds fatLock, writerLock and the writeLock of every writer.
+//returns 0 if the line was dropped, -1 if it has to stay
+int evictLine(fs_t * fs, int line)
+{
+   int first = line * fs->cacheLineBlocks;
+   int count = (first + fs->cacheLineBlocks > blockCount(fs)) ? blockCount(fs) - first : fs->cacheLineBlocks;
+   int written = 0;
+   for (int i = first; i < first + count; i++)
+   {
+      if (!holdsFileData(fs, i))
+         return -1;
+      written |= (__atomic_load_n(&fs->unsyncedBlocks[i / 64], __ATOMIC_RELAXED) >> (i % 64)) & 1;
+   }
+   
+   Byte * start = (Byte *)blockAddress(fs, first);
+   size_t length = (size_t)count * blockSize(fs);
+   if (written) {
+      //a private mapping would lose the line, a shared one keeps it dirty in the page cache
+      if ((fs->volume.journalBlocks > 0) ? (writeImage(fs, start, length, (off_t)first * blockSize(fs)) != 0)
+                                         : (msync(start, length, MS_SYNC) != 0))
+         return -1;
+      COUNT(fs, cacheWriteBacks, count);
+   }
+   
+   madvise(start, length, MADV_DONTNEED);
+   if (fs->volume.journalBlocks == 0)
+      posix_fadvise(fs->diskFd, (off_t)first * blockSize(fs), length, POSIX_FADV_DONTNEED);
+   COUNT(fs, cacheEvictions, 1);
+   return 0;
+}
+
+//Put line of block, which a handle borrows, in the cache.
+//Caller holds volumeLock, but no lock below it.
+void cacheBlock(fs_t * fs, int block)
+{
+   if (!fs->diskIsMapped || (fs->cacheCapacity == 0))
+      return;
+   
+   int line = block / fs->cacheLineBlocks;
+   uint64_t bit = (uint64_t)1 << (line % 64);
+   if (__atomic_load_n(&fs->cachedLines[line / 64], __ATOMIC_ACQUIRE) & bit) {
+      //usually set already, as it is for every block of a line in turn
+      if (!(__atomic_load_n(&fs->referencedLines[line / 64], __ATOMIC_RELAXED) & bit))
+         __atomic_fetch_or(&fs->referencedLines[line / 64], bit, __ATOMIC_RELAXED);
+      return;
+   }
+   
+   //take a free slot while there is one
+   pthread_mutex_lock(&fs->cacheLock);
+   int full = (fs->cacheUsed == fs->cacheCapacity);
+   if (!full && !(fs->cachedLines[line / 64] & bit)) {
+      fs->cacheRing[fs->cacheUsed++] = line;
+      __atomic_fetch_or(&fs->cachedLines[line / 64], bit, __ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&fs->cacheLock);
+   if (!full || (knowDirBlocks(fs) != 0))
+      return;
+   
+   //nothing may write into a line while it is dropped
+   lockFAT(fs);
+   pthread_mutex_lock(&fs->writerLock);
+   for (MyFILE * stream = fs->writers; stream != NULL; stream = stream->nextWriter)
+      pthread_mutex_lock(&stream->writeLock);
+   pthread_mutex_lock(&fs->cacheLock);
+   
+   //two rounds clear every bit, lines which cannot be dropped may still fill the cache
+   for (int step = 0; (step < 2 * fs->cacheCapacity) && !(fs->cachedLines[line / 64] & bit); step++)
+   {
+      int slot = fs->cacheHand;
+      int victim = fs->cacheRing[slot];
+      uint64_t victimBit = (uint64_t)1 << (victim % 64);
+      fs->cacheHand = (slot + 1) % fs->cacheCapacity;
+      
+      if (__atomic_fetch_and(&fs->referencedLines[victim / 64], ~victimBit, __ATOMIC_RELAXED) & victimBit)
+         continue;
+      if (evictLine(fs, victim) != 0)
+         continue;
+      
+      __atomic_fetch_and(&fs->cachedLines[victim / 64], ~victimBit, __ATOMIC_RELEASE);
+      fs->cacheRing[slot] = line;
+      __atomic_fetch_or(&fs->cachedLines[line / 64], bit, __ATOMIC_RELEASE);
+   }
+   
+   pthread_mutex_unlock(&fs->cacheLock);
+   for (MyFILE * stream = fs->writers; stream != NULL; stream = stream->nextWriter)
+      pthread_mutex_unlock(&stream->writeLock);
+   pthread_mutex_unlock(&fs->writerLock);
+   unlockFAT(fs);
+}
+
+
+//Number of bytes of the file which reside in its last block.
+//A chain always has exactly ceil(fileLength / blockSize) blocks (at least one),
+//so a non-empty file whose length is a multiple of blockSize fills its last block.
+int bytesInLastBlock(fs_t * fs, int fileLength)
+{
+   if (fileLength == 0)
+      return 0;
+   return ((fileLength - 1) % blockSize(fs)) + 1;
+}
+
+//Moves stream to the beginning of the next block of its chain.
+//If the buffer holds the last block of the file, a block is appended: the
+//next one of the old chain if the file was truncated by 'w', else a new one.
+//returns 1 on success, 0 if the disk is full
+int moveToNextBlock(MyFILE * stream)
+{
+   fs_t * fs = stream->fs;
+   int nextBlockIndex;
+   
+   lockVolume(fs);
+   if (stream->currBlockIndex == stream->lastBlockIndex)
+   {
+      lockFAT(fs);
+      if (stream->spareCount > 0) {
+         //reuse next block of the old chain, it is already taken in FAT
+         nextBlockIndex = stream->spareNext;
+         stream->spareNext = fs->FAT[nextBlockIndex];
+         stream->spareCount--;
+         setFATEntry(fs, nextBlockIndex, ENDOFCHAIN);
+      } else if (stream->reservedCount > 0) {
+         //take next block reserved by myfallocate, it is already taken in FAT
+         nextBlockIndex = stream->reservedNext;
+         stream->reservedNext++;
+         stream->reservedCount--;
+      } else {
+         nextBlockIndex = findFreeBlockAfter(fs, stream->lastBlockIndex);
+         if (nextBlockIndex != NO_FREE_BLOCKS)
+            setFATEntry(fs, nextBlockIndex, ENDOFCHAIN);
+      }
+      if (nextBlockIndex != NO_FREE_BLOCKS)
+         setFATEntry(fs, stream->currBlockIndex, nextBlockIndex);
+      unlockFAT(fs);
+      
+      if (nextBlockIndex == NO_FREE_BLOCKS) {
+         unlockVolume(fs);
+         //not logged, writers keep trying byte after byte
+         lastError = FS_ERR_NO_SPACE;
+         return 0;
+      }
+      stream->lastBlockIndex = nextBlockIndex;
    } else {
-      newFile->pos = 0;
-      newFile->currBlockIndex = currDirBlock.dir.entryList[entryIndex].firstBlock;
+      nextBlockIndex = fs->FAT[stream->currBlockIndex];
+      COUNT(fs, chainHops, 1);
    }
-   //allocation based on currBlockIndex set above
    
-   //loading buffer
-   loadBlock(&(newFile->buffer), (newFile->currBlockIndex));
+   stream->pos = 0;
+   //read by isFileBlock on engine threads
+   __atomic_store_n(&stream->currBlockIndex, nextBlockIndex, __ATOMIC_RELAXED);
+   stream->currBlockNumber++;
+   stream->sequentialBlocks++;
+   borrowBlock(stream);
+   readAhead(stream);
+   unlockVolume(fs);
+   return 1;
+}
+
+void myfputc(Byte b, MyFILE * stream)
+{
+   fs_t * fs = stream->fs;
+   //If in read mode, nothing to do in here.
+   if (stream->mode == 'r')
+      return;
    
-   //cleanup
-   free(filename);
+   //fileLength is always equal to (last available position + 1).
+   //If current position is at the end of file, the file is being extended
+   //and fileLength should be updated once the byte is written.
+   int atEndOfFile = (stream->currBlockIndex == stream->lastBlockIndex)
+                     && (stream->pos == bytesInLastBlock(fs, stream->fileLength));
    
-   //return handle to the structure
-   return newFile;
+   //If (position after last available position) then save buffer and
+   //load next block, allocating a new one if buffer holds the ENDOFCHAIN block.
+   //If the disk is full the byte is dropped.
+   if ((stream->pos == blockSize(fs)) && (moveToNextBlock(stream) == 0))
+      return;
+
+   //finally write byte B into buffer, see holdWriters
+   pthread_mutex_lock(&stream->writeLock);
+   stream->buffer->data[stream->pos] = b;
+   pthread_mutex_unlock(&stream->writeLock);
+   COUNT(fs, bytesWritten, 1);
+   
+   //if byte was written at the end of file, increase file size
+   if (atEndOfFile)
+      stream->fileLength++;                                       
+   stream->pos++;
+}
+
+int myfgetc(MyFILE * stream)
+{
+   fs_t * fs = stream->fs;
+   if ((stream->pos >= bytesInLastBlock(fs, stream->fileLength))          //if position is after last position...
+         && (stream->currBlockIndex == stream->lastBlockIndex))        //...in last block,
+   {
+      return EOF;                                                      //position ran out of file.
+   }
+   
+   //If (position is after last available position) 
+   // and (NOT in last block)***
+   //then next block must be loaded to read rest of the file
+   //
+   //** second condition works implicitly
+   if (stream->pos == blockSize(fs))                                
+      moveToNextBlock(stream);
+   
+   //increasing position
+   stream->pos++;
+   COUNT(fs, bytesRead, 1);
+   return stream->buffer->data[stream->pos - 1];
+}
+
+//Reads up to size bytes into ptr, copying whole spans of the buffer at once.
+//returns number of bytes read, which is smaller than size only at the end of file
+size_t myfread(void * ptr, size_t size, MyFILE * stream)
+{
+   fs_t * fs = stream->fs;
+   Byte * dest = ptr;
+   size_t done = 0;
+   
+   while (done < size)
+   {
+      //bytes of the current block which still belong to the file
+      int available = blockSize(fs) - stream->pos;
+      if (stream->currBlockIndex == stream->lastBlockIndex)
+         available = bytesInLastBlock(fs, stream->fileLength) - stream->pos;
+      
+      if (available <= 0) {
+         //end of file reached
+         if (stream->currBlockIndex == stream->lastBlockIndex)
+            break;
+         moveToNextBlock(stream);
+         continue;
+      }
+      
+      size_t chunk = size - done;
+      if (chunk > (size_t)available)
+         chunk = available;
+      
+      memcpy(dest + done, stream->buffer->data + stream->pos, chunk);
+      stream->pos += chunk;
+      done += chunk;
+   }
+   COUNT(fs, bytesRead, done);
+   return done;
+}
+
+//Writes size bytes from ptr, filling the buffer a block at a time and
+//extending the chain as needed.
+//returns number of bytes written, which is smaller than size only if the disk is full
+size_t myfwrite(const void * ptr, size_t size, MyFILE * stream)
+{
+   fs_t * fs = stream->fs;
+   const Byte * src = ptr;
+   size_t done = 0;
+   
+   //If in read mode, nothing to do in here.
+   if (stream->mode == 'r')
+      return 0;
+   
+   while (done < size)
+   {
+      //bytes of the file already in the current block, if it is the last one
+      int used = bytesInLastBlock(fs, stream->fileLength);
+      
+      if (stream->pos == blockSize(fs))
+      {
+         //a block appended to the chain holds nothing yet
+         if (stream->currBlockIndex == stream->lastBlockIndex)
+            used = 0;
+         if (moveToNextBlock(stream) == 0)
+            break;
+      }
+      
+      size_t chunk = size - done;
+      if (chunk > (size_t)(blockSize(fs) - stream->pos))
+         chunk = blockSize(fs) - stream->pos;
+      
+      pthread_mutex_lock(&stream->writeLock);
+      memcpy(stream->buffer->data + stream->pos, src + done, chunk);
+      pthread_mutex_unlock(&stream->writeLock);
+      stream->pos += chunk;
+      done += chunk;
+      
+      //if last block was written past its previous end, the file has grown
+      if ((stream->currBlockIndex == stream->lastBlockIndex) && (stream->pos > used))
+         stream->fileLength += stream->pos - used;
+   }
+   COUNT(fs, bytesWritten, done);
+   return done;
+}
+
+//Index of block number blockNumber of the chain of stream. Blocks are
+//remembered in stream->chain as the chain is followed, so that each block
+//is looked up in FAT only once for the life of the handle.
+//returns index of the block, or NO_FREE_BLOCKS if the chain could not be recorded
+fatEntry_t getBlockOfFile(MyFILE * stream, int blockNumber)
+{
+   fs_t * fs = stream->fs;
+   if (blockNumber >= stream->chainCapacity)
+   {
+      int capacity = (stream->chainCapacity == 0) ? 16 : stream->chainCapacity;
+      while (capacity <= blockNumber)
+         capacity *= 2;
+      
+      fatEntry_t * chain = realloc(stream->chain, capacity * sizeof(fatEntry_t));
+      if (chain == NULL)
+         return NO_FREE_BLOCKS;
+      stream->chain = chain;
+      stream->chainCapacity = capacity;
+   }
+   
+   if (stream->chainLength == 0)
+      stream->chain[stream->chainLength++] = viewEntry(fs, &stream->entryRef)->firstBlock;
+   
+   while (stream->chainLength <= blockNumber)
+   {
+      stream->chain[stream->chainLength] = fs->FAT[stream->chain[stream->chainLength - 1]];
+      stream->chainLength++;
+      COUNT(fs, chainHops, 1);
+   }
+   return stream->chain[blockNumber];
+}
+
+//returns current position in stream, counted in bytes from beginning of file
+long myftell(MyFILE * stream)
+{
+   return (long)stream->currBlockNumber * blockSize(stream->fs) + stream->pos;
+}
+
+//Set position in stream to offset bytes from beginning (SEEK_SET), current
+//position (SEEK_CUR) or end (SEEK_END) of file, as fseek does.
+//The new position must lie within the file or at its end.
+//returns 0 on success, SEEK_FAILED otherwise
+int myfseek(MyFILE * stream, long offset, int whence)
+{
+   fs_t * fs = stream->fs;
+   long target;
+   
+   if (whence == SEEK_SET)
+      target = offset;
+   else if (whence == SEEK_CUR)
+      target = myftell(stream) + offset;
+   else if (whence == SEEK_END)
+      target = stream->fileLength + offset;
+   else
+      return SEEK_FAILED;
+   
+   if ((target < 0) || (target > stream->fileLength))
+      return SEEK_FAILED;
+   
+   //a position at a block boundary is kept at the end of the block before,
+   //as the block after it does not exist at the end of file
+   int blockNumber = target / blockSize(fs);
+   int pos = target % blockSize(fs);
+   if ((pos == 0) && (blockNumber > 0)) {
+      blockNumber--;
+      pos = blockSize(fs);
+   }
+   
+   if (blockNumber != stream->currBlockNumber)
+   {
+      lockVolume(fs);
+      fatEntry_t blockIndex = getBlockOfFile(stream, blockNumber);
+      if (blockIndex == NO_FREE_BLOCKS) {
+         unlockVolume(fs);
+         return SEEK_FAILED;
+      }
+      
+      __atomic_store_n(&stream->currBlockIndex, blockIndex, __ATOMIC_RELAXED);
+      stream->currBlockNumber = blockNumber;
+      borrowBlock(stream);
+      unlockVolume(fs);
+      
+      //access is no longer sequential
+      stream->sequentialBlocks = 0;
+      stream->readaheadEnd = blockNumber;
+   }
+   
+   stream->pos = pos;
+   return 0;
 }
 
-void myfclose(MyFILE	* stream)
+//Set length of the file of stream to size bytes. A shorter file gives its
+//tail blocks back at once, a longer one is extended with zeros. Position is
+//kept, unless it is past the new end of file, where it is moved to.
+//returns 0 on success, FS_FAILED otherwise
+int myftruncate(MyFILE * stream, long size)
+{
+   fs_t * fs = stream->fs;
+   if (stream->mode == 'r')
+      return fail(fs, FS_ERR_INVALID, "handle is read only");
+   if ((size < 0) || (size > INT32_MAX))
+      return fail(fs, FS_ERR_INVALID, "size");
+   
+   long position = myftell(stream);
+   
+   if (size > stream->fileLength)
+   {
+      //freed blocks are not always zeroed, so zeros are written
+      Byte zeros[MINBLOCKSIZE];
+      memset(zeros, 0x0, sizeof(zeros));
+      
+      myfseek(stream, 0, SEEK_END);
+      while (stream->fileLength < size)
+      {
+         size_t chunk = size - stream->fileLength;
+         if (chunk > sizeof(zeros))
+            chunk = sizeof(zeros);
+         if (myfwrite(zeros, chunk, stream) < chunk) {
+            myfseek(stream, position, SEEK_SET);
+            return fail(fs, FS_ERR_NO_SPACE, NULL);
+         }
+      }
+      myfseek(stream, position, SEEK_SET);
+      return 0;
+   }
+   
+   //chain keeps at least one block
+   int keptBlocks = (size + blockSize(fs) - 1) / blockSize(fs);
+   if (keptBlocks == 0)
+      keptBlocks = 1;
+   
+   lockVolume(fs);
+   fatEntry_t last = getBlockOfFile(stream, keptBlocks - 1);
+   if (last == NO_FREE_BLOCKS) {
+      unlockVolume(fs);
+      return fail(fs, FS_ERR_NO_MEMORY, NULL);
+   }
+   releaseReservation(stream);
+   stream->lastBlockIndex = last;
+   freeTail(stream);
+   stream->fileLength = size;
+   if (stream->chainLength > keptBlocks)
+      stream->chainLength = keptBlocks;
+   if (stream->readaheadEnd > keptBlocks)
+      stream->readaheadEnd = keptBlocks;
+   unlockVolume(fs);
+   
+   //current block may be gone, it is looked up again
+   if (position > size)
+      position = size;
+   stream->currBlockNumber = -1;
+   myfseek(stream, position, SEEK_SET);
+   return 0;
+}
+
+
+/* I/O engine
+ * 
+ * fs_io_start runs a pool of threads which carry out block requests
+ * submitted with fs_io_submit, in order of submission but many at once.
+ * A request copies the block under the volume lock, so the waiting happens
+ * on an engine thread when the block still has to come from an image: a
+ * page of a mapped image faulting in, or a group of an image read by
+ * readDisk being loaded. A completed request is passed to its done
+ * callback, or else queued for fs_io_poll. myfreadbulk uses the engine to
+ * have every block of a read in flight at once.
+ * 
+ * Writes go around the journal and the directory caches, so they are only
+ * carried out on blocks of files, see isFileBlock; other writes complete
+ * with FS_ERR_INVALID.
+ */
+
+//returns 1 if the engine may write block: it holds data of a file, and it
+//is not the block a handle is writing in place. Caller holds fatLock.
+int isFileBlock(fs_t * fs, int block)
+{
+   if (!holdsFileData(fs, block))
+      return 0;
+   
+   int borrowed = 0;
+   pthread_mutex_lock(&fs->writerLock);
+   for (MyFILE * stream = fs->writers; (stream != NULL) && !borrowed; stream = stream->nextWriter)
+      borrowed = (__atomic_load_n(&stream->currBlockIndex, __ATOMIC_RELAXED) == block);
+   pthread_mutex_unlock(&fs->writerLock);
+   return !borrowed;
+}
+
+//Carry out a request on an engine thread.
+void performRequest(fs_t * fs, fs_io_request_t * request)
+{
+   lockVolume(fs);
+   if ((request->block < 0) || (request->block >= blockCount(fs)) || (request->buffer == NULL))
+      request->result = FS_ERR_INVALID;
+   else if (request->op == FS_IO_READ)
+      memcpy(request->buffer, blockAddress(fs, request->block)->data, blockSize(fs));
+   else if (request->op != FS_IO_WRITE)
+      request->result = FS_ERR_INVALID;
+   else if ((request->result = knowDirBlocks(fs)) == 0) {
+      //the block is brought in first, fatLock is not held while waiting for it
+      blockAddress(fs, request->block);
+      //the block must not change hands while it is written
+      lockFAT(fs);
+      if (isFileBlock(fs, request->block))
+         memcpy(editBlock(fs, request->block)->data, request->buffer, blockSize(fs));
+      else
+         request->result = FS_ERR_INVALID;
+      unlockFAT(fs);
+   }
+   unlockVolume(fs);
+   COUNT(fs, ioRequests, 1);
+}
+
+void * ioThread(void * arg)
+{
+   fs_t * fs = arg;
+   ioEngine_t * io = fs->io;
+   
+   pthread_mutex_lock(&io->lock);
+   for (;;)
+   {
+      while ((io->queueFirst == NULL) && !io->stopping)
+         pthread_cond_wait(&io->submitted, &io->lock);
+      //requests still queued are carried out before the engine stops
+      fs_io_request_t * request = io->queueFirst;
+      if (request == NULL)
+         break;
+      io->queueFirst = request->next;
+      if (io->queueFirst == NULL)
+         io->queueLast = NULL;
+      pthread_mutex_unlock(&io->lock);
+      
+      performRequest(fs, request);
+      //the request may be gone once done returns
+      int collect = (request->done == NULL);
+      if (!collect)
+         request->done(request);
+      
+      pthread_mutex_lock(&io->lock);
+      if (collect) {
+         request->next = NULL;
+         if (io->doneLast == NULL)
+            io->doneFirst = request;
+         else
+            io->doneLast->next = request;
+         io->doneLast = request;
+      }
+      io->inFlight--;
+      //fs_io_poll waits for a collectable request or for none to be in flight
+      if (collect || (io->inFlight == 0))
+         pthread_cond_broadcast(&io->completed);
+   }
+   pthread_mutex_unlock(&io->lock);
+   return NULL;
+}
+
+/* fs_io_start : starts the I/O engine of a context
+ * 
+ * Must not be called while other threads use the engine, the same goes for
+ * fs_io_stop.
+ * 
+ * in: context, number of threads, DEFAULTIOTHREADS if 0 or less
+ * returns: 0 on success, FS_FAILED if the engine runs already or threads cannot be started
+ */
+
+int fs_io_start(fs_t * fs, int threads)
+{
+   if (fs->io != NULL)
+      return fail(fs, FS_ERR_BUSY, "I/O engine");
+   if (threads <= 0)
+      threads = DEFAULTIOTHREADS;
+   
+   ioEngine_t * io = calloc(1, sizeof(ioEngine_t));
+   if ((io == NULL) || ((io->threads = malloc(threads * sizeof(pthread_t))) == NULL)) {
+      free(io);
+      return fail(fs, FS_ERR_NO_MEMORY, NULL);
+   }
+   pthread_mutex_init(&io->lock, NULL);
+   pthread_cond_init(&io->submitted, NULL);
+   pthread_cond_init(&io->completed, NULL);
+   fs->io = io;
+   
+   for (; io->threadCount < threads; io->threadCount++)
+   {
+      if (pthread_create(&io->threads[io->threadCount], NULL, ioThread, fs) != 0)
+         break;
+   }
+   if (io->threadCount == 0) {
+      fs_io_stop(fs);
+      return fail(fs, FS_ERR_NO_MEMORY, "I/O threads");
+   }
+   return 0;
+}
+
+//Stop the I/O engine once requests submitted so far are carried out.
+//Completed requests not polled yet are dropped, they belong to the caller anyway.
+void fs_io_stop(fs_t * fs)
+{
+   ioEngine_t * io = fs->io;
+   if (io == NULL)
+      return;
+   
+   pthread_mutex_lock(&io->lock);
+   io->stopping = 1;
+   pthread_cond_broadcast(&io->submitted);
+   pthread_mutex_unlock(&io->lock);
+   for (int i = 0; i < io->threadCount; i++)
+      pthread_join(io->threads[i], NULL);
+   
+   fs->io = NULL;
+   pthread_mutex_destroy(&io->lock);
+   pthread_cond_destroy(&io->submitted);
+   pthread_cond_destroy(&io->completed);
+   free(io->threads);
+   free(io);
+}
+
+/* fs_io_submit : queues block requests for the I/O engine
+ * 
+ * in: context, count requests, filled in up to and including context
+ * returns: 0 on success, FS_FAILED if the engine is not running
+ * A write to a block which is not a block of a file completes with
+ * FS_ERR_INVALID, see isFileBlock.
+ */
+
+int fs_io_submit(fs_t * fs, fs_io_request_t * const * requests, int count)
 {
-   if ((stream->mode == 'w') || (stream->mode == 'a'))
+   ioEngine_t * io = fs->io;
+   if (io == NULL)
+      return fail(fs, FS_ERR_INVALID, "I/O engine not started");
+   if (count <= 0)
+      return 0;
+   
+   //link the batch first, so it is queued at once
+   for (int i = 0; i < count; i++)
    {
-      //saving buffer
-      writeBlock(&stream->buffer, stream->currBlockIndex);
-      
-      //updating file length in dirEntry
-      diskBlock_t buffer;
-      loadBlock(&buffer, stream->parentBlockIndex);
-      buffer.dir.entryList[stream->parentEntrylistIndex].fileLength = stream->fileLength;
-      writeBlock(&buffer, stream->parentBlockIndex);
+      requests[i]->result = 0;
+      requests[i]->next = (i + 1 < count) ? requests[i + 1] : NULL;
    }
    
-   //free the dynamically allocated memory 
-   free(stream);
+   pthread_mutex_lock(&io->lock);
+   if (io->queueLast == NULL)
+      io->queueFirst = requests[0];
+   else
+      io->queueLast->next = requests[0];
+   io->queueLast = requests[count - 1];
+   io->inFlight += count;
+   pthread_cond_broadcast(&io->submitted);
+   pthread_mutex_unlock(&io->lock);
+   return 0;
 }
 
+/* fs_io_poll : collects completed requests which have no done callback
+ * 
+ * in: context, room for max requests, whether to wait for at least one
+ *     if none has completed yet but some are in flight
+ * returns: number of requests stored in completed, FS_FAILED if the engine is not running
+ */
 
-void myfputc(Byte b, MyFILE * stream)
+int fs_io_poll(fs_t * fs, fs_io_request_t ** completed, int max, int wait)
 {
-   //If in read mode, nothing to do in here.
-   if (stream->mode == 'r')
-      return;
+   ioEngine_t * io = fs->io;
+   if (io == NULL)
+      return fail(fs, FS_ERR_INVALID, "I/O engine not started");
    
+   pthread_mutex_lock(&io->lock);
+   while (wait && (io->doneFirst == NULL) && (io->inFlight > 0))
+      pthread_cond_wait(&io->completed, &io->lock);
    
-   //If (position after last available position) AND (ENDOFCHAIN block in buffer)
-   //function should save buffer and allocate new one.
-   if ((stream->pos == BLOCKSIZE)  
-         && (stream->currBlockIndex == stream->lastBlockIndex))     
-   {
-      //Find free block
-      int freeBlockIndex = findFreeBlock();
-      if (freeBlockIndex == NO_FREE_BLOCKS)
-         return;
-      
-      //Update FAT table
-      FAT[stream->currBlockIndex] = freeBlockIndex;
-      FAT[freeBlockIndex] = ENDOFCHAIN;
-      copyFAT();
-      
-      //Save buffer before loading new block
-      writeBlock(&(stream->buffer), stream->currBlockIndex);
-      
-      //Updating filedescriptor
-      stream->pos = 0;
-      stream->lastBlockIndex = freeBlockIndex;
-      stream->currBlockIndex = freeBlockIndex;
-      
-      //Loading recently allocated block
-      loadBlock(&(stream->buffer), stream->currBlockIndex);
-   } 
-
-
-   //If (position after last available position) AND (not ENDOFCHAIN block in buffer)
-   //then save previous block and load next one.
-   //
-   //Note: altought second condition is not explicty stated, it does not need to be:
-   //    if (position after last available position) AND (endofchain block in buffer)
-   //    position would have been changed by preceding IF
-   if (stream->pos == BLOCKSIZE) 
+   int count = 0;
+   while ((count < max) && (io->doneFirst != NULL))
    {
-      //save buffer
-      writeBlock(&(stream->buffer), stream->currBlockIndex);
-      //update filedescriptor
-      stream->currBlockIndex = FAT[stream->currBlockIndex];
-      stream->pos = 0;
-      //load new block into buffer
-      loadBlock(&(stream->buffer), stream->currBlockIndex);
+      completed[count++] = io->doneFirst;
+      io->doneFirst = io->doneFirst->next;
    }
+   if (io->doneFirst == NULL)
+      io->doneLast = NULL;
+   pthread_mutex_unlock(&io->lock);
+   return count;
+}
 
-   //finally write byte B into buffer
-   stream->buffer.data[stream->pos] = b;
-   
-   //fileLength is always equal to (last available position + 1).
-   //If current position is equal to fileLength, it means file
-   //has just been extended, so fileLength should be updated.
-   
-   //if position is equal to fileLength, increase file size
-   if ((stream->pos == (stream->fileLength % BLOCKSIZE))          //If position is equal to length of the part of the file,
-                                                                  // which resides in last block
-         && (stream->currBlockIndex == stream->lastBlockIndex))   //AND last block is currently in buffer
-      stream->fileLength++;                                       
-   stream->pos++;
+//Requests of one myfreadbulk, counted down as they complete.
+typedef struct ioBatch {
+   pthread_mutex_t lock;
+   pthread_cond_t  finished;
+   int             pending;
+   int             result;
+} ioBatch_t;
+
+void batchRequestDone(fs_io_request_t * request)
+{
+   ioBatch_t * batch = request->context;
+   pthread_mutex_lock(&batch->lock);
+   if (request->result != 0)
+      batch->result = request->result;
+   if (--batch->pending == 0)
+      pthread_cond_signal(&batch->finished);
+   pthread_mutex_unlock(&batch->lock);
 }
 
-int myfgetc(MyFILE * stream)
+/* myfreadbulk : reads like myfread, with every block of the read in flight at once
+ * 
+ * The blocks are looked up along the chain up front and submitted to the
+ * I/O engine in one batch. Whole blocks go straight into ptr, the partial
+ * blocks at either end through a buffer. Without a running engine, or for
+ * reads of less than two blocks, it is myfread.
+ * 
+ * in: destination, bytes to read, handle
+ * returns: number of bytes read, less than size at end of file or on failure
+ */
+
+size_t myfreadbulk(void * ptr, size_t size, MyFILE * stream)
 {
-   if ((stream->pos % BLOCKSIZE == (stream->fileLength % BLOCKSIZE))   //if position is after last position...
-         && (stream->currBlockIndex == stream->lastBlockIndex))        //...in last block,
-   {
-      return EOF;                                                      //position ran out of file.
+   fs_t * fs = stream->fs;
+   long position = myftell(stream);
+   if (size > (size_t)(stream->fileLength - position))
+      size = stream->fileLength - position;
+   if ((fs->io == NULL) || (size < 2 * (size_t)blockSize(fs)))
+      return myfread(ptr, size, stream);
+   
+   long end = position + (long)size;
+   int firstNumber = position / blockSize(fs);
+   int count = (end - 1) / blockSize(fs) - firstNumber + 1;
+   fs_io_request_t * requests = calloc(count, sizeof(fs_io_request_t));
+   fs_io_request_t ** list = malloc(count * sizeof(fs_io_request_t *));
+   Byte * edges = malloc(2 * (size_t)blockSize(fs));
+   if ((requests == NULL) || (list == NULL) || (edges == NULL)) {
+      free(requests);
+      free(list);
+      free(edges);
+      return myfread(ptr, size, stream);
    }
    
-   //If (position is after last available position) 
-   // and (NOT in last block)***
-   //then next block must be loaded to read rest of the file
-   //
-   //** second condition works implicitly
-   if (stream->pos == BLOCKSIZE)                                
+   //the whole chain up to the last block is recorded in stream->chain
+   lockVolume(fs);
+   int found = (getBlockOfFile(stream, firstNumber + count - 1) != NO_FREE_BLOCKS);
+   unlockVolume(fs);
+   if (!found) {
+      free(requests);
+      free(list);
+      free(edges);
+      return myfread(ptr, size, stream);
+   }
+   
+   ioBatch_t batch = { .pending = count, .result = 0 };
+   pthread_mutex_init(&batch.lock, NULL);
+   pthread_cond_init(&batch.finished, NULL);
+   Byte * dest = ptr;
+   for (int i = 0; i < count; i++)
    {
-      if (stream->mode != 'r')
-         writeBlock(&(stream->buffer), (stream->currBlockIndex));
-         
-      stream->pos = 0;
-      stream->currBlockIndex = FAT[stream->currBlockIndex];
-      loadBlock(&(stream->buffer), (stream->currBlockIndex));
+      long blockStart = (long)(firstNumber + i) * blockSize(fs);
+      int whole = (blockStart >= position) && (blockStart + blockSize(fs) <= end);
+      requests[i].op = FS_IO_READ;
+      requests[i].block = stream->chain[firstNumber + i];
+      requests[i].buffer = whole ? dest + (blockStart - position) : edges + ((i == 0) ? 0 : blockSize(fs));
+      requests[i].done = batchRequestDone;
+      requests[i].context = &batch;
+      list[i] = &requests[i];
    }
    
-   //increasing position
-   stream->pos++;
-   return stream->buffer.data[stream->pos - 1];
+   size_t done = 0;
+   if (fs_io_submit(fs, list, count) == 0)
+   {
+      pthread_mutex_lock(&batch.lock);
+      while (batch.pending > 0)
+         pthread_cond_wait(&batch.finished, &batch.lock);
+      pthread_mutex_unlock(&batch.lock);
+      
+      if (batch.result == 0)
+      {
+         //partial blocks at the ends
+         int head = position % blockSize(fs);
+         if (head != 0)
+            memcpy(dest, edges + head, blockSize(fs) - head);
+         long tailStart = (end - 1) / blockSize(fs) * (long)blockSize(fs);
+         if ((end - tailStart < blockSize(fs)) && (tailStart >= position))
+            memcpy(dest + (tailStart - position), edges + blockSize(fs), end - tailStart);
+         done = size;
+         myfseek(stream, end, SEEK_SET);
+         COUNT(fs, bytesRead, done);
+      } else {
+         fail(fs, batch.result, NULL);
+      }
+   }
+   pthread_cond_destroy(&batch.finished);
+   pthread_mutex_destroy(&batch.lock);
+   free(requests);
+   free(list);
+   free(edges);
+   return done;
 }
 
 
@@ -566,10 +3958,12 @@ int myfgetc(MyFILE * stream)
 
 
 
-void makeDir(fatEntry_t index, char * nameOfDir)
+//returns 0 on success, FS_FAILED if there is no room for the folder
+int makeDir(fs_t * fs, fatEntry_t index, char * nameOfDir)
 {
-   if (allocateNewEntry(index, nameOfDir, 1) == ALLOCATION_FAILED)
-      printf("\nAllocation failed (no room for new entry or overlapping name?)");
+   if (allocateNewEntry(fs, index, nameOfDir, 1, NULL) == ALLOCATION_FAILED)
+      return fail(fs, FS_ERR_NO_SPACE, nameOfDir);
+   return 0;
 }
 
 // This function provided with index of a dir block responsible for first directory
@@ -578,17 +3972,19 @@ void makeDir(fatEntry_t index, char * nameOfDir)
 // Exemplary path: aaa/bbb/ccc.
 // getFirstBlockOEntry(index_of_block_aaa, "bbb") return index_of_block_bbb
 // getFirstBlockOfEntry(index_of_block_bbb, "ccc") return index_of_block_ccc
-int getFirstBlockOfEntry(int indexOfDirectory, char * nameOfEntry)
+int getFirstBlockOfEntry(fs_t * fs, int indexOfDirectory, const char * nameOfEntry)
 {
-   int entryIndex = findEntryByName(indexOfDirectory, nameOfEntry);
+   dirEntryRef_t ref;
+   fatEntry_t firstBlock;
    
-   if (entryIndex == FILE_NOT_FOUND)
-      return ENTRY_NOT_FOUND;
+   lockDir(fs, indexOfDirectory);
+   int found = lookupDentry(fs, indexOfDirectory, nameOfEntry, &ref, &firstBlock);
+   unlockDir(fs, indexOfDirectory);
    
-   diskBlock_t diskBlock;
-   loadBlock(&diskBlock, indexOfDirectory);
+   if (found == FILE_NOT_FOUND)
+      return ENTRY_NOT_FOUND;
    
-   return diskBlock.dir.entryList[entryIndex].firstBlock;
+   return firstBlock;
 }
 
 int getNumberOfSlashes(const char * sequence)
@@ -599,67 +3995,76 @@ int getNumberOfSlashes(const char * sequence)
 }
 
 
-//input: path, * array of strings, size of array of strings
-//writes: array of strings
-//returns: number of strings that were saved
-int processPath(const char * inputPath, char ** listOfEntries, int lengthOfList)
+//input: path, which is split in place, array of names, size of array of names
+//writes: array of names, pointing into path
+//returns: number of names that were saved
+int processPath(char * path, char ** listOfEntries, int lengthOfList)
 {
-   //inputPath could be in immutable memory
-   char path[MAXNAME];
-   strcpy(path, inputPath);
-   
-   //setup strtok and extract first name in path
    char *saveptr, *buffer;
-   buffer = __strtok_r(path, "/", &saveptr);
-   if (buffer == NULL) {
-      return 0;
-   }
-   strncpy(listOfEntries[0], buffer, MAXNAME);
+   int usedElements = 0;
    
-   //extract rest of path
-   int usedElemenets;
-   for (usedElemenets = 1; usedElemenets < lengthOfList; usedElemenets++)
+   for (buffer = __strtok_r(path, "/", &saveptr);
+        (buffer != NULL) && (usedElements < lengthOfList);
+        buffer = __strtok_r(NULL, "/", &saveptr))
    {
-      buffer =  __strtok_r(NULL, "/", &saveptr);
-      if (buffer == NULL)
-         break;
-      strncpy(listOfEntries[usedElemenets], buffer, MAXNAME);
+      listOfEntries[usedElements++] = buffer;
    }
    
-   return usedElemenets;
+   return usedElements;
 }
 
 
-
-void getDirNameFromItsIndex(char * name, int index) {
-   if (index == 3) {
+void getDirNameFromItsIndex(fs_t * fs, char * name, int index) {
+   if (index == fs->rootDirIndex) {
       strcpy(name, "root");
       return;
    }
-   diskBlock_t diskBlock;
-   //load block
-   loadBlock(&diskBlock, index);
-   //load its parents
-   loadBlock(&diskBlock, diskBlock.dir.parentBlockIndex);
-   
    //iterate over parent's entries
-   for (int i = 0; i < diskBlock.dir.nextEntry; i++) {
-      if ((diskBlock.dir.entryList[i].firstBlock == index) && (diskBlock.dir.entryList[i].unUsed == 0)) {
-         strcpy(name, diskBlock.dir.entryList[i].name);
-         return;
+   int parent = getParentBlock(fs, index);
+   dirEntryRef_t ref;
+   lockDir(fs, parent);
+   for (firstDirEntry(parent, &ref); atDirEntry(fs, &ref); nextDirEntry(fs, &ref)) {
+      const dirEntry_t * entry = viewEntry(fs, &ref);
+      if ((entry->firstBlock == index) && (entry->unUsed == 0)) {
+         strcpy(name, entry->name);
+         break;
       }
    }
+   unlockDir(fs, parent);
 }
 
-folderAndEntry setFolderAndEntry(char ** listOfEntries, int lengthOfList, int isRelative)
+//Look up entryName of details in its folder, setting entryFound,
+//entryFirstBlock and entryRef. Caller holds lock of the folder.
+void findEntryOfDetails(fs_t * fs, folderAndEntry * details)
+{
+   details->entryFound = 0;
+   details->entryFirstBlock = ENTRY_NOT_FOUND;
+   
+   if (lookupDentry(fs, details->folderFirstBlock, details->entryName, &details->entryRef, &details->entryFirstBlock) == 0)
+      details->entryFound = 1;
+}
+
+folderAndEntry setFolderAndEntry(fs_t * fs, char ** listOfEntries, int lengthOfList, int isRelative)
 {
    int firstBlock;
    folderAndEntry details;
+   details.pathToFolderFound = 0;
+   details.entryFound = 0;
+   details.entryFirstBlock = ENTRY_NOT_FOUND;
+   
+   //no entry can have a longer name
+   for (int i = 0; i < lengthOfList; i++)
+   {
+      if (strlen(listOfEntries[i]) >= MAXNAME) {
+         fail(fs, FS_ERR_NAME_TOO_LONG, NULL);
+         return details;
+      }
+   }
    
    if (isRelative == RELATIVE_PATH) {     //relative path
-      firstBlock = currentDirIndex;
+      firstBlock = getCurrentDirIndex(fs);
    } else {                   //absolute path
-      firstBlock = rootDirIndex;
+      firstBlock = fs->rootDirIndex;
    }
    
    int blockOfEntry;
@@ -669,11 +4074,9 @@ folderAndEntry setFolderAndEntry(char ** listOfEntries, int lengthOfList, int is
    {
       //special case
       if (strcmp(listOfEntries[i], "..") == 0) {
-         blockOfEntry = getParentBlock(firstBlock);
-         if (firstBlock == 0) {
-            printf("\nError: path points to parent of root.");
-            details.pathToFolderFound = 0;
-            details.entryFound = 0;
+         blockOfEntry = getParentBlock(fs, firstBlock);
+         if (blockOfEntry == 0) {
+            fail(fs, FS_ERR_BAD_PATH, "path points to parent of root");
             return details;
          }
          
@@ -681,12 +4084,13 @@ folderAndEntry setFolderAndEntry(char ** listOfEntries, int lengthOfList, int is
          continue;
       }
       //find next folder
-      blockOfEntry = getFirstBlockOfEntry(firstBlock, listOfEntries[i]);
+      blockOfEntry = getFirstBlockOfEntry(fs, firstBlock, listOfEntries[i]);
       
       //if folder with this name does not exist return error
       if (blockOfEntry == ENTRY_NOT_FOUND)
       {
          details.pathToFolderFound = 0;
+         fail(fs, FS_ERR_NOT_FOUND, listOfEntries[i]);
          return details;
       }
       //if exists, set firstBlock 
@@ -705,62 +4109,55 @@ folderAndEntry setFolderAndEntry(char ** listOfEntries, int lengthOfList, int is
    }
    
    if (strcmp(details.folderName, "..") == 0) {
-      getDirNameFromItsIndex(details.folderName, details.folderFirstBlock);
+      getDirNameFromItsIndex(fs, details.folderName, details.folderFirstBlock);
    }
    
    strcpy(details.entryName, listOfEntries[i]);
-   //details.entryFirstBlock = ?
-
-   
-   int buffer = getFirstBlockOfEntry(firstBlock, listOfEntries[i]);
    
-   if (buffer == ENTRY_NOT_FOUND) {
-      details.entryFound = 0;
-   } else {
-      details.entryFound = 1;
-      details.entryFirstBlock = buffer;
-   }
-
+   lockDir(fs, firstBlock);
+   findEntryOfDetails(fs, &details);
+   unlockDir(fs, firstBlock);
    
    return details;
 }
 
 
-folderAndEntry getDetailsFromPath(const char * inputPath)
+//Resolve path into its folder and entry. If the folder is not found,
+//pathToFolderFound is 0 and the reason is recorded for fs_last_error.
+folderAndEntry getDetailsFromPath(fs_t * fs, const char * inputPath)
 {
-   char path[strlen(inputPath)];
-   if ((inputPath[0] == '.') && (inputPath[1] == '/')) {
-      memmove(path, inputPath+2, strlen(inputPath));
-   } else {
-      strcpy(path, inputPath);
-   }
-   
    folderAndEntry details;
    details.pathToFolderFound = 0;
    details.entryFound = 0;
+   details.entryFirstBlock = ENTRY_NOT_FOUND;
    
-   if (strlen(path) == 0) {
-      printf("\nPath of length 0");
+   if ((inputPath[0] == '.') && (inputPath[1] == '/'))
+      inputPath += 2;
+   
+   size_t length = strlen(inputPath);
+   if (length == 0) {
+      fail(fs, FS_ERR_BAD_PATH, "path of length 0");
+      return details;
+   }
+   if (length > MAXPATHLENGTH) {
+      fail(fs, FS_ERR_BAD_PATH, "path too long");
       return details;
    }
    
+   //path is split on the stack, names in listOfEntries point into it
+   char path[MAXPATHLENGTH + 1];
+   strcpy(path, inputPath);
+   
    //count number of slashes in path
    int lengthOfList = getNumberOfSlashes(path) + 1;  // + 1 because relative path has
                                                    // more elements than slashes
-   
-   //create an empty array to store entries' names
-   char ** listOfEntries = malloc(lengthOfList * sizeof(char*));
-   for (int i = 0; i < lengthOfList; i++)
-   {
-      listOfEntries[i] = malloc((MAXNAME + 1) * sizeof(char));
-      memset(listOfEntries[i], '\0', (MAXNAME));
-   }
+   char * listOfEntries[MAXPATHLENGTH + 1];
    
    //get entries' names
    int usedElements = processPath(path, listOfEntries, lengthOfList);
    //if no elements were written return error
    if (usedElements == 0) {
-      printf("\nIncorrect path");
+      fail(fs, FS_ERR_BAD_PATH, inputPath);
       return details;
    }
 
@@ -769,95 +4166,187 @@ folderAndEntry getDetailsFromPath(const char * inputPath)
       //printf("\n :: %s", listOfEntries[i]);
       
    //check if path exists
-   if ((path[0] == '/') ||          //if path is absolute, 
-       (currentDir == NULL))   {    //or currentDir is root and relative can be treated as absolute
-      details = setFolderAndEntry(listOfEntries, usedElements, ABSOLUTE_PATH);
+   if (inputPath[0] == '/') {       //if path is absolute
+      details = setFolderAndEntry(fs, listOfEntries, usedElements, ABSOLUTE_PATH);
    } else {
-      details = setFolderAndEntry(listOfEntries, usedElements, RELATIVE_PATH);
+      details = setFolderAndEntry(fs, listOfEntries, usedElements, RELATIVE_PATH);
    }
-      
-   //cleanup
-   for (int i = 0; i < lengthOfList; i++)
-      free(listOfEntries[i]);
-   free(listOfEntries);
-
 
    return details;
 }
 
 
-void mymkdir(char * path)
+int mymkdir(fs_t * fs, char * path)
 {
-
-   folderAndEntry details = getDetailsFromPath(path);
+   lockVolume(fs);
+   folderAndEntry details = getDetailsFromPath(fs, path);
    
    if (details.pathToFolderFound == 0) {
-      printf("\nError: path to folder not found.");
-      return;
-   }
-   if (details.entryFound == 1) {
-      printf("\nError: existing folder or file collides with given filename.");
-      return;
+      unlockVolume(fs);
+      return FS_FAILED;
    }
    
-   makeDir(details.folderFirstBlock, details.entryName);
+   int result;
+   lockDir(fs, details.folderFirstBlock);
+   findEntryOfDetails(fs, &details);
+   if (details.entryFound == 1)
+      result = fail(fs, FS_ERR_EXISTS, details.entryName);
+   else
+      result = makeDir(fs, details.folderFirstBlock, details.entryName);
+   unlockDir(fs, details.folderFirstBlock);
+   unlockVolume(fs);
+   return result;
 }
 
-char ** listDir(fatEntry_t index) {
-   diskBlock_t diskBlock;
-   loadBlock(&diskBlock, index);
+//returns NULL terminated list of names in directory, NULL if out of memory
+char ** listDir(fs_t * fs, fatEntry_t index) {
+   dirEntryRef_t ref;
+   
+   lockDir(fs, index);
+   //count used entries
+   int count = 0;
+   for (firstDirEntry(index, &ref); atDirEntry(fs, &ref); nextDirEntry(fs, &ref))
+   {
+      if (viewEntry(fs, &ref)->unUsed == 0)
+         count++;
+   }
    
    //create an empty array to store names
-   char ** listOfEntries = malloc((DIRENTRYCOUNT + 1) * sizeof(char*));
-   for (int i = 0; i < DIRENTRYCOUNT + 1; i++)
-      listOfEntries[i] = NULL;
+   char ** listOfEntries = calloc(count + 1, sizeof(char*));
+   if (listOfEntries == NULL) {
+      unlockDir(fs, index);
+      fail(fs, FS_ERR_NO_MEMORY, NULL);
+      return NULL;
+   }
       
-   int shift = 0;
-   for (int i = 0; i < DIRENTRYCOUNT; i++)   {
-      if ((diskBlock.dir.entryList[i].unUsed == 1) || (diskBlock.dir.entryList[i].name[0] == '\0'))
-      {
-         shift++;
+   int i = 0;
+   for (firstDirEntry(index, &ref); atDirEntry(fs, &ref); nextDirEntry(fs, &ref))   {
+      const dirEntry_t * entry = viewEntry(fs, &ref);
+      if (entry->unUsed == 1)
          continue;
+      listOfEntries[i] = malloc((MAXNAME + 1) * sizeof(char));
+      if (listOfEntries[i] == NULL) {
+         unlockDir(fs, index);
+         freeList(listOfEntries);
+         fail(fs, FS_ERR_NO_MEMORY, NULL);
+         return NULL;
       }
-      listOfEntries[i - shift] = malloc((MAXNAME + 1) * sizeof(char));
-      memset(listOfEntries[i - shift], '\0', (MAXNAME));
-      strcpy(listOfEntries[i - shift], diskBlock.dir.entryList[i].name);
-      printf("\n%s", listOfEntries[i - shift]);
+      strcpy(listOfEntries[i], entry->name);
+      i++;
    }
+   unlockDir(fs, index);
    
    return listOfEntries;
-   /*   //cleanup
-   for (int i = 0; i < DIRENTRYCOUNT; i++)
-      free(listOfEntries[i]);
-   free(listOfEntries);*/
 }
 
 void freeList(char ** listOfEntries)
 {
-   for (int i = 0; i < DIRENTRYCOUNT + 1; i++)
-   {
-      if (listOfEntries[i] != NULL)
-         free(listOfEntries[i]);
-   }
+   for (int i = 0; listOfEntries[i] != NULL; i++)
+      free(listOfEntries[i]);
    free(listOfEntries);
 }
 
-char ** mylistdir(const char * path)
+//First block of directory at path, "." being the current directory.
+//Caller holds volumeLock.
+//returns ENTRY_NOT_FOUND, with the reason recorded, if path does not lead to a directory
+fatEntry_t findDirectory(fs_t * fs, const char * path)
 {
    if (strcmp(path, ".") == 0)
-   {
-      printf("\nContent of %s: ", path);
-      return listDir(currentDirIndex);
-   }
+      return getCurrentDirIndex(fs);
+   if (strcmp(path, "/") == 0)
+      return fs->rootDirIndex;
+   
+   folderAndEntry details = getDetailsFromPath(fs, path);
+   if (details.pathToFolderFound == 0)
+      return ENTRY_NOT_FOUND;
    
-   folderAndEntry details = getDetailsFromPath(path);
+   //entry could have gone since the path was resolved
+   lockDir(fs, details.folderFirstBlock);
+   findEntryOfDetails(fs, &details);
+   int isDir = details.entryFound && viewEntry(fs, &details.entryRef)->isDir;
+   unlockDir(fs, details.folderFirstBlock);
    
-   if ((details.pathToFolderFound == 0) || (details.entryFound == 0)) {
-      printf("\nError: path is incorrect");
+   if (details.entryFound == 0) {
+      fail(fs, FS_ERR_NOT_FOUND, path);
+      return ENTRY_NOT_FOUND;
+   }
+   if (!isDir) {
+      fail(fs, FS_ERR_NOT_DIR, path);
+      return ENTRY_NOT_FOUND;
+   }
+   return details.entryFirstBlock;
+}
+
+//returns NULL terminated list of names in directory at path, NULL if it cannot be listed
+char ** mylistdir(fs_t * fs, const char * path)
+{
+   char ** list = NULL;
+   
+   lockVolume(fs);
+   fatEntry_t dirBlockIndex = findDirectory(fs, path);
+   if (dirBlockIndex != ENTRY_NOT_FOUND)
+      list = listDir(fs, dirBlockIndex);
+   unlockVolume(fs);
+   return list;
+}
+
+
+/* directory iterator
+ * 
+ * myreaddir walks the blocks of a directory and returns its used entries in
+ * place, so name, fileLength, isDir and modTime are read straight from the
+ * disk without copying, allocating or printing. An entry stays readable until
+ * the disk is formatted, read, mapped or unmapped again, and shows later
+ * changes made to it. Entries added during the walk may or may not be seen.
+ * A directory must not be removed while it is open.
+ */
+
+//returns handle on directory at path ("." for current directory),
+//or NULL if path does not lead to a directory
+MyDIR * myopendir(fs_t * fs, const char * path)
+{
+   lockVolume(fs);
+   fatEntry_t dirBlockIndex = findDirectory(fs, path);
+   if (dirBlockIndex == ENTRY_NOT_FOUND) {
+      unlockVolume(fs);
       return NULL;
    }
-   printf("\nContent of %s: ", path);
-   return listDir(details.entryFirstBlock);
+   
+   MyDIR * dir = malloc(sizeof(MyDIR));
+   if (dir != NULL) {
+      dir->fs = fs;
+      dir->dirBlockIndex = dirBlockIndex;
+      firstDirEntry(dirBlockIndex, &dir->next);
+   } else {
+      fail(fs, FS_ERR_NO_MEMORY, NULL);
+   }
+   unlockVolume(fs);
+   return dir;
+}
+
+//returns next used entry of dir, or NULL once all were returned
+const dirEntry_t * myreaddir(MyDIR * dir)
+{
+   fs_t * fs = dir->fs;
+   const dirEntry_t * entry = NULL;
+   
+   lockVolume(fs);
+   lockDir(fs, dir->dirBlockIndex);
+   while ((entry == NULL) && atDirEntry(fs, &dir->next))
+   {
+      const dirEntry_t * current = viewEntry(fs, &dir->next);
+      nextDirEntry(fs, &dir->next);
+      if (current->unUsed == 0)
+         entry = current;
+   }
+   unlockDir(fs, dir->dirBlockIndex);
+   unlockVolume(fs);
+   return entry;
+}
+
+void myclosedir(MyDIR * dir)
+{
+   free(dir);
 }
 
 
@@ -865,103 +4354,124 @@ char ** mylistdir(const char * path)
    FUNCTIONS FOR GCS A5-A1 BELOW
 *****/
 
-int getParentBlock(int indexOfDirectory)
+int getParentBlock(fs_t * fs, int indexOfDirectory)
 {
-   diskBlock_t diskBlock;
-   loadBlock(&diskBlock, indexOfDirectory);
-   return diskBlock.dir.parentBlockIndex;
+   return viewBlock(fs, indexOfDirectory)->dir.parentBlockIndex;
 }
 
 
-void setCurrentDir(dirEntry_t buffer)
+void setCurrentDir(fs_t * fs, const dirEntry_t * entry)
 {
-   staticBufferForCurrentDir = buffer;
-   currentDir = &staticBufferForCurrentDir;
-   currentDirIndex = currentDir->firstBlock;
-   printf("\nCurrent dir: %s", currentDir->name);
+   pthread_mutex_lock(&fs->cwdLock);
+   copyDirEntry(&fs->staticBufferForCurrentDir, entry);
+   fs->currentDir = &fs->staticBufferForCurrentDir;
+   fs->currentDirIndex = fs->currentDir->firstBlock;
+   pthread_mutex_unlock(&fs->cwdLock);
+   logMessage(fs, FS_LOG_INFO, "Current dir: %s", entry->name);
 }
 
-void mychdir(char * path)
+int mychdir(fs_t * fs, char * path)
 {
+   lockVolume(fs);
    if (strcmp(path, "/") == 0) {
-      setCurrentDirToRoot();
-      return;
+      setCurrentDirToRoot(fs);
+      unlockVolume(fs);
+      return 0;
    } 
    if (strcmp(path, "..") == 0) {
-      if (currentDirIndex == rootDirIndex) {
-         printf("Error: you can't go below root dir.");
+      int current = getCurrentDirIndex(fs);
+      if (current == fs->rootDirIndex) {
+         unlockVolume(fs);
+         return fail(fs, FS_ERR_BAD_PATH, "you can't go below root dir");
       }
-      int parent = getParentBlock(currentDirIndex);
-      int grandParent = getParentBlock(parent);
+      int parent = getParentBlock(fs, current);
+      int grandParent = getParentBlock(fs, parent);
       if (grandParent == 0) {
-         setCurrentDirToRoot();
-         return;
+         setCurrentDirToRoot(fs);
+         unlockVolume(fs);
+         return 0;
       }
-      diskBlock_t diskBlock;
-      loadBlock(&diskBlock, grandParent);
       //find parent's entry in grandparent
-      int i;
-      for (i = 0; i < diskBlock.dir.nextEntry; i++) {
-         if (diskBlock.dir.entryList[i].firstBlock == parent) 
+      dirEntryRef_t ref;
+      lockDir(fs, grandParent);
+      for (firstDirEntry(grandParent, &ref); atDirEntry(fs, &ref); nextDirEntry(fs, &ref)) {
+         if ((viewEntry(fs, &ref)->firstBlock == parent) && (viewEntry(fs, &ref)->unUsed == 0)) {
+            setCurrentDir(fs, viewEntry(fs, &ref));
             break;
+         }
       }
-      setCurrentDir(diskBlock.dir.entryList[i]);
-      return;
+      unlockDir(fs, grandParent);
+      unlockVolume(fs);
+      return 0;
    }
    
-   folderAndEntry details = getDetailsFromPath(path);
-   if ((details.pathToFolderFound == 0) || (details.entryFound == 0)) {
-      printf("\nError: path is incorrect");
-      return;
+   folderAndEntry details = getDetailsFromPath(fs, path);
+   if (details.pathToFolderFound == 0) {
+      unlockVolume(fs);
+      return FS_FAILED;
    }
-   currentDirIndex = details.entryFirstBlock;
-   
-   diskBlock_t buffer;
-   loadBlock(&buffer, details.folderFirstBlock);
-   
-   //if it could return error, then test above would be failed
-   int entryIndex = findEntryByName(details.folderFirstBlock, details.entryName);
-   
-   setCurrentDir(buffer.dir.entryList[entryIndex]);
    
+   int result = 0;
+   lockDir(fs, details.folderFirstBlock);
+   findEntryOfDetails(fs, &details);
+   if (details.entryFound == 0)
+      result = fail(fs, FS_ERR_NOT_FOUND, path);
+   else if (!viewEntry(fs, &details.entryRef)->isDir)
+      result = fail(fs, FS_ERR_NOT_DIR, path);
+   else
+      setCurrentDir(fs, viewEntry(fs, &details.entryRef));
+   unlockDir(fs, details.folderFirstBlock);
+   unlockVolume(fs);
+   return result;
 }
 
-void myremove(char * path) 
+int myremove(fs_t * fs, char * path) 
 {
-   folderAndEntry details = getDetailsFromPath(path);
-   if ((details.pathToFolderFound == 0) || (details.entryFound == 0)) {
-      printf("\nError: file not found");
-      return;
+   lockVolume(fs);
+   folderAndEntry details = getDetailsFromPath(fs, path);
+   if (details.pathToFolderFound == 0) {
+      unlockVolume(fs);
+      return FS_FAILED;
+   }
+   lockDir(fs, details.folderFirstBlock);
+   findEntryOfDetails(fs, &details);
+   if (details.entryFound == 0) {
+      unlockDir(fs, details.folderFirstBlock);
+      unlockVolume(fs);
+      return fail(fs, FS_ERR_NOT_FOUND, path);
    }
    
    
-   //update entrylist in parent folder
-   diskBlock_t diskBlock;
-   loadBlock(&diskBlock, details.folderFirstBlock);
+   //update entry in parent folder
+   dirEntryRef_t ref = details.entryRef;
    
    //check if not a folder
-   if (diskBlock.dir.entryList[ findEntryByName(details.folderFirstBlock, details.entryName) ].isDir == 1) {
-      printf("\nError: path leads to a folder.");
-      return;  
+   if (viewEntry(fs, &ref)->isDir == 1) {
+      unlockDir(fs, details.folderFirstBlock);
+      unlockVolume(fs);
+      return fail(fs, FS_ERR_IS_DIR, path);
    }
-   diskBlock.dir.entryList[ findEntryByName(details.folderFirstBlock, details.entryName) ].unUsed = 1;
-   writeBlock(&diskBlock, details.folderFirstBlock);
+   editEntry(fs, &ref)->unUsed = 1;
+   dropDirIndex(fs, details.folderFirstBlock);
+   dropDentry(fs, details.folderFirstBlock, details.entryName);
+   unlockDir(fs, details.folderFirstBlock);
    
-   // clean fat table and overwrite blocks with zeros
-   // *** Please note I am aware it is not neccessary to overwrite 
-   // blocks with zeros for disk to work correctly. I am doing this
-   // to ensure disk does not have any clutter and facilitate marking.
-   clearChain(details.entryFirstBlock);
+   // clean fat table, blocks are zeroed as chosen by fs_set_zeroing:
+   // by default not here but later by fs_scrub or writeDisk
+   lockFAT(fs);
+   clearChain(fs, details.entryFirstBlock);
+   unlockFAT(fs);
+   unlockVolume(fs);
+   return 0;
 }
 
-int anyUsedEntryInside(fatEntry_t blockIndex) 
+int anyUsedEntryInside(fs_t * fs, fatEntry_t blockIndex) 
 {
-   diskBlock_t diskBlock;
-   loadBlock(&diskBlock, blockIndex);
+   dirEntryRef_t ref;
    
-   for (int i = 0; i < diskBlock.dir.nextEntry; i++)
+   for (firstDirEntry(blockIndex, &ref); atDirEntry(fs, &ref); nextDirEntry(fs, &ref))
    {
-      if (diskBlock.dir.entryList[i].unUsed == 0)
+      if (viewEntry(fs, &ref)->unUsed == 0)
       {
          return 1;
       }
@@ -969,81 +4479,375 @@ int anyUsedEntryInside(fatEntry_t blockIndex)
    return 0;
 }
 
-void myrmdir(char * path) 
+int myrmdir(fs_t * fs, char * path) 
 {
-   folderAndEntry details = getDetailsFromPath(path);
+   //no other call may be resolving a path through the folder
+   lockVolumeExclusive(fs);
+   folderAndEntry details = getDetailsFromPath(fs, path);
    
-   if ((details.entryFirstBlock == currentDirIndex) || (strcmp(path, ".") == 0)) {
-      printf("\nError: you cannot remove the folder in which you currently are.");
-      return;
+   if ((details.entryFirstBlock == getCurrentDirIndex(fs)) || (strcmp(path, ".") == 0)) {
+      unlockVolume(fs);
+      return fail(fs, FS_ERR_BUSY, path);
    }
    
-   if ((details.pathToFolderFound == 0) || (details.entryFound == 0)) {
-      printf("\nError: folder not found");
-      return;
+   if (details.pathToFolderFound == 0) {
+      unlockVolume(fs);
+      return FS_FAILED;
    }
-   
-   if (anyUsedEntryInside(details.entryFirstBlock) == 1) {
-      printf("\nError: you cannot remove a non empty folder.");
-      return;
+   if (details.entryFound == 0) {
+      unlockVolume(fs);
+      return fail(fs, FS_ERR_NOT_FOUND, path);
+   }
+   if (!viewEntry(fs, &details.entryRef)->isDir) {
+      unlockVolume(fs);
+      return fail(fs, FS_ERR_NOT_DIR, path);
    }
    
-   diskBlock_t diskBlock;
-   loadBlock(&diskBlock, details.folderFirstBlock);
+   if (anyUsedEntryInside(fs, details.entryFirstBlock) == 1) {
+      unlockVolume(fs);
+      return fail(fs, FS_ERR_NOT_EMPTY, path);
+   }
    
-   int entryIndex = findEntryByName(details.folderFirstBlock, details.entryName);
-   diskBlock.dir.entryList[entryIndex].unUsed = 1;
+   editEntry(fs, &details.entryRef)->unUsed = 1;
+   dropDirIndex(fs, details.folderFirstBlock);
+   dropDirIndex(fs, details.entryFirstBlock);
+   dropDentry(fs, details.folderFirstBlock, details.entryName);
+   dropDentriesOfDir(fs, details.entryFirstBlock);
    
-   writeBlock(&diskBlock, details.folderFirstBlock);
    //clear block and fat
-   clearChain(details.entryFirstBlock);
+   lockFAT(fs);
+   clearChain(fs, details.entryFirstBlock);
+   unlockFAT(fs);
+   unlockVolume(fs);
+   return 0;
 }
 
-void copyRealFileToMyDisk(char * realPath, char * path)
+int copyRealFileToMyDisk(fs_t * fs, char * realPath, char * path)
 {
-   MyFILE * file = myfopen(path, 'w');
    FILE * realFile = fopen(realPath, "r");
+   if (realFile == NULL)
+      return fail(fs, FS_ERR_IO, realPath);
    
-   if ((file == NULL) || (realFile == NULL)) {
-      if (file != NULL)
-         myfclose(file);
-      if (realFile != NULL)
-         fclose(realFile);
-      printf("\nError: at least one of the paths is incorrect.")
-      return;
+   size_t bufferSize = (size_t)COPYBUFFERBLOCKS * blockSize(fs);
+   Byte * buffer = malloc(bufferSize);
+   if (buffer == NULL) {
+      fclose(realFile);
+      return fail(fs, FS_ERR_NO_MEMORY, NULL);
+   }
+   
+   MyFILE * file = myfopen(fs, path, 'w');
+   if (file == NULL) {
+      free(buffer);
+      fclose(realFile);
+      return FS_FAILED;
    }
    
-   int buffer = fgetc(realFile);
-   while (buffer != EOF) {
-      myfputc(buffer, file);
-      buffer = fgetc(realFile);
+   //the whole file goes into one contiguous run if there is one
+   struct stat info;
+   if ((fstat(fileno(realFile), &info) == 0) && (info.st_size > 0) && (info.st_size <= INT32_MAX))
+      myfallocate(file, (int)info.st_size);
+   
+   int result = 0;
+   size_t count;
+   while ((count = fread(buffer, 1, bufferSize, realFile)) > 0) {
+      if (myfwrite(buffer, count, file) < count) {
+         result = fail(fs, FS_ERR_NO_SPACE, path);
+         break;
+      }
    }
+   if ((result == 0) && ferror(realFile))
+      result = fail(fs, FS_ERR_IO, realPath);
    
    myfclose(file);
    fclose(realFile);
+   free(buffer);
+   return result;
 }
 
-void copyMyFileToRealDisk(char * realPath, char * path)
+int copyMyFileToRealDisk(fs_t * fs, char * realPath, char * path)
 {
-   MyFILE * file = myfopen(path, 'r');
+   MyFILE * file = myfopen(fs, path, 'r');
+   if (file == NULL)
+      return FS_FAILED;
+   
    FILE * realFile = fopen(realPath, "w");
+   if (realFile == NULL) {
+      myfclose(file);
+      return fail(fs, FS_ERR_IO, realPath);
+   }
    
-   if ((file == NULL) || (realFile == NULL)) {
-      if (file != NULL)
-         myfclose(file);
-      if (realFile != NULL)
-         fclose(realFile);
-      printf("\nError: at least one of the paths is incorrect.")
-      return;
+   size_t bufferSize = (size_t)COPYBUFFERBLOCKS * blockSize(fs);
+   Byte * buffer = malloc(bufferSize);
+   int result = (buffer == NULL) ? fail(fs, FS_ERR_NO_MEMORY, NULL) : 0;
+   size_t count;
+   while ((result == 0) && (count = myfreadbulk(buffer, bufferSize, file)) > 0) {
+      if (fwrite(buffer, 1, count, realFile) < count)
+         result = fail(fs, FS_ERR_IO, realPath);
+   }
+   
+   myfclose(file);
+   if ((fclose(realFile) != 0) && (result == 0))
+      result = fail(fs, FS_ERR_IO, realPath);
+   free(buffer);
+   return result;
+}
+
+
+/* batch copies
+ * 
+ * A batch of files is copied by a number of threads, each taking the next
+ * pair of the list in turn, so reading one file overlaps with allocating
+ * and writing others. Each file gets its blocks as one contiguous run
+ * through myfallocate. Trees are walked on the calling thread first,
+ * directories are created as they are found, then their files are copied
+ * as one batch.
+ */
+
+//A batch being copied and the next pair of it to take.
+typedef struct copyBatch {
+   fs_t       * fs;
+   char * const * realPaths;
+   char * const * paths;
+   int          count;
+   int          toDisk;           // copying into the disk, else out of it
+   int          next;             // taken atomically
+   int        * results;          // FS_OK or error of each pair, may be NULL
+   int          firstError;       // error of the lowest pair which failed, FS_OK if none
+   int          firstFailed;
+   pthread_mutex_t lock;          // firstError and firstFailed
+} copyBatch_t;
+
+void * copyThread(void * arg)
+{
+   copyBatch_t * batch = arg;
+   int i;
+   while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count)
+   {
+      int result = batch->toDisk ? copyRealFileToMyDisk(batch->fs, batch->realPaths[i], batch->paths[i])
+                                 : copyMyFileToRealDisk(batch->fs, batch->realPaths[i], batch->paths[i]);
+      //the reason of a failure is known to this thread only
+      int error = (result == 0) ? FS_OK : fs_last_error();
+      if (batch->results != NULL)
+         batch->results[i] = error;
+      if (error != FS_OK) {
+         pthread_mutex_lock(&batch->lock);
+         if (i < batch->firstFailed) {
+            batch->firstFailed = i;
+            batch->firstError = error;
+         }
+         pthread_mutex_unlock(&batch->lock);
+      }
+   }
+   return NULL;
+}
+
+//Copy count pairs on up to threads threads, DEFAULTCOPYTHREADS if 0 or less.
+//returns 0 if all pairs were copied, FS_FAILED with the error of the first failed pair otherwise
+int copyBatch(fs_t * fs, char * const * realPaths, char * const * paths, int count, int threads, int * results, int toDisk)
+{
+   copyBatch_t batch = { fs, realPaths, paths, count, toDisk, 0, results, FS_OK, count, PTHREAD_MUTEX_INITIALIZER };
+   if (threads <= 0)
+      threads = DEFAULTCOPYTHREADS;
+   if (threads > count)
+      threads = count;
+   
+   //the calling thread is one of them
+   pthread_t * workers = malloc(threads * sizeof(pthread_t));
+   int started = 0;
+   while ((workers != NULL) && (started < threads - 1)
+         && (pthread_create(&workers[started], NULL, copyThread, &batch) == 0))
+      started++;
+   copyThread(&batch);
+   for (int i = 0; i < started; i++)
+      pthread_join(workers[i], NULL);
+   free(workers);
+   pthread_mutex_destroy(&batch.lock);
+   
+   if (batch.firstError != FS_OK)
+      return fail(fs, batch.firstError, (toDisk ? paths : realPaths)[batch.firstFailed]);
+   return 0;
+}
+
+/* copyRealFilesToMyDisk : copies host files into the disk, several at once
+ * 
+ * in: context, count host files and paths on the disk to copy them to,
+ *     number of threads, DEFAULTCOPYTHREADS if 0 or less,
+ *     room for the result of each pair (FS_OK or FS_ERR code) or NULL
+ * returns: 0 if all files were copied, FS_FAILED otherwise
+ */
+
+int copyRealFilesToMyDisk(fs_t * fs, char * const * realPaths, char * const * paths, int count, int threads, int * results)
+{
+   return copyBatch(fs, realPaths, paths, count, threads, results, 1);
+}
+
+//As copyRealFilesToMyDisk, from files of the disk to host files.
+int copyMyFilesToRealDisk(fs_t * fs, char * const * realPaths, char * const * paths, int count, int threads, int * results)
+{
+   return copyBatch(fs, realPaths, paths, count, threads, results, 0);
+}
+
+//Pairs of paths collected while walking a tree.
+typedef struct pathList {
+   char ** realPaths;
+   char ** paths;
+   int     count;
+   int     capacity;
+} pathList_t;
+
+//returns 0, or -1 if out of memory
+int addPathPair(pathList_t * list, const char * realPath, const char * path)
+{
+   if (list->count == list->capacity)
+   {
+      int capacity = (list->capacity == 0) ? 64 : list->capacity * 2;
+      char ** realPaths = realloc(list->realPaths, capacity * sizeof(char *));
+      if (realPaths != NULL)
+         list->realPaths = realPaths;
+      char ** paths = realloc(list->paths, capacity * sizeof(char *));
+      if (paths != NULL)
+         list->paths = paths;
+      if ((realPaths == NULL) || (paths == NULL))
+         return -1;
+      list->capacity = capacity;
+   }
+   list->realPaths[list->count] = strdup(realPath);
+   list->paths[list->count] = strdup(path);
+   list->count++;
+   if ((list->realPaths[list->count - 1] == NULL) || (list->paths[list->count - 1] == NULL))
+      return -1;
+   return 0;
+}
+
+void freePathList(pathList_t * list)
+{
+   for (int i = 0; i < list->count; i++)
+   {
+      free(list->realPaths[i]);
+      free(list->paths[i]);
+   }
+   free(list->realPaths);
+   free(list->paths);
+}
+
+//Join directory and name with a slash.
+//returns a new string, NULL if out of memory
+char * joinPath(const char * dir, const char * name)
+{
+   size_t length = strlen(dir);
+   int slash = (length > 0) && (dir[length - 1] != '/');
+   char * path = malloc(length + slash + strlen(name) + 1);
+   if (path != NULL)
+      sprintf(path, "%s%s%s", dir, slash ? "/" : "", name);
+   return path;
+}
+
+//Create directories of host tree realDir below dir on the disk and collect its files.
+//returns 0, or error of the first directory which could not be walked or created
+int walkRealTree(fs_t * fs, const char * realDir, const char * dir, pathList_t * files)
+{
+   //root and a directory which is there already are used as they are
+   if ((strcmp(dir, "/") != 0) && (mymkdir(fs, (char *)dir) != 0)) {
+      if (fs_last_error() != FS_ERR_EXISTS)
+         return fs_last_error();
+      MyDIR * existing = myopendir(fs, dir);
+      if (existing == NULL)
+         return fs_last_error();
+      myclosedir(existing);
    }
    
-   int buffer = myfgetc(file);
+   DIR * host = opendir(realDir);
+   if (host == NULL)
+      return FS_ERR_IO;
    
-   while (buffer != EOF) {
-      fputc(buffer, realFile);
-      buffer = myfgetc(file);
+   int result = 0;
+   struct dirent * entry;
+   while ((result == 0) && ((entry = readdir(host)) != NULL))
+   {
+      if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0))
+         continue;
+      char * realPath = joinPath(realDir, entry->d_name);
+      char * path = joinPath(dir, entry->d_name);
+      struct stat info;
+      if ((realPath == NULL) || (path == NULL))
+         result = FS_ERR_NO_MEMORY;
+      else if (lstat(realPath, &info) != 0)
+         result = FS_ERR_IO;
+      else if (S_ISDIR(info.st_mode))
+         result = walkRealTree(fs, realPath, path, files);
+      //links are only followed to files, a link to a directory may lead back into the tree
+      else if ((S_ISREG(info.st_mode) || (S_ISLNK(info.st_mode) && (stat(realPath, &info) == 0) && S_ISREG(info.st_mode)))
+               && (addPathPair(files, realPath, path) != 0))
+         result = FS_ERR_NO_MEMORY;
+      free(realPath);
+      free(path);
    }
+   closedir(host);
+   return result;
+}
+
+//Create directories of tree dir on the disk below host directory realDir and collect its files.
+//returns 0, or error of the first directory which could not be walked or created
+int walkMyTree(fs_t * fs, const char * realDir, const char * dir, pathList_t * files)
+{
+   struct stat info;
+   if ((mkdir(realDir, 0755) != 0) && ((errno != EEXIST) || (stat(realDir, &info) != 0) || !S_ISDIR(info.st_mode)))
+      return FS_ERR_IO;
    
-   myfclose(file);
-   fclose(realFile);
+   MyDIR * disk = myopendir(fs, dir);
+   if (disk == NULL)
+      return fs_last_error();
+   
+   int result = 0;
+   const dirEntry_t * entry;
+   while ((result == 0) && ((entry = myreaddir(disk)) != NULL))
+   {
+      char * realPath = joinPath(realDir, entry->name);
+      char * path = joinPath(dir, entry->name);
+      if ((realPath == NULL) || (path == NULL))
+         result = FS_ERR_NO_MEMORY;
+      else if (entry->isDir)
+         result = walkMyTree(fs, realPath, path, files);
+      else if (addPathPair(files, realPath, path) != 0)
+         result = FS_ERR_NO_MEMORY;
+      free(realPath);
+      free(path);
+   }
+   myclosedir(disk);
+   return result;
+}
+
+/* copyRealTreeToMyDisk : copies host directory tree realDir to dir on the disk
+ * 
+ * Directories are created as needed, files are copied as one batch,
+ * other kinds of host files are left out.
+ * 
+ * in: context, host directory, directory on the disk, number of threads,
+ *     DEFAULTCOPYTHREADS if 0 or less
+ * returns: 0 if the whole tree was copied, FS_FAILED otherwise
+ */
+
+int copyRealTreeToMyDisk(fs_t * fs, const char * realDir, const char * dir, int threads)
+{
+   pathList_t files = { NULL, NULL, 0, 0 };
+   int result = walkRealTree(fs, realDir, dir, &files);
+   if (result != 0)
+      result = fail(fs, result, realDir);
+   else if (files.count > 0)
+      result = copyRealFilesToMyDisk(fs, files.realPaths, files.paths, files.count, threads, NULL);
+   freePathList(&files);
+   return result;
+}
+
+//As copyRealTreeToMyDisk, from directory tree dir on the disk to host directory realDir.
+int copyMyTreeToRealDisk(fs_t * fs, const char * realDir, const char * dir, int threads)
+{
+   pathList_t files = { NULL, NULL, 0, 0 };
+   int result = walkMyTree(fs, realDir, dir, &files);
+   if (result != 0)
+      result = fail(fs, result, dir);
+   else if (files.count > 0)
+      result = copyMyFilesToRealDisk(fs, files.realPaths, files.paths, files.count, threads, NULL);
+   freePathList(&files);
+   return result;
 }
\ No newline at end of file
@@ -8,6 +8,10 @@
 #ifndef FILESYS_H
 #define FILESYS_H
 
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <time.h>
 
 #ifndef TRUE
@@ -17,11 +21,28 @@
 #define FALSE 0
 #endif
 
-#define MAXBLOCKS     1024
-#define BLOCKSIZE     1024
-#define FATENTRYCOUNT (BLOCKSIZE / sizeof(fatEntry_t))
-#define DIRENTRYCOUNT ((BLOCKSIZE - (2*sizeof(int)) ) / sizeof(dirEntry_t))
+//Geometry used by format(NULL)
+#define DEFAULTBLOCKCOUNT 1024
+#define DEFAULTBLOCKSIZE  1024
+#define DEFAULTFATWIDTH   16
+#define DEFAULTJOURNALBLOCKS 32   // blocks, see format
+#define DEFAULTREADAHEAD  32      // blocks, see fs_set_readahead
+#define DEFAULTCACHEBLOCKS 65536  // blocks, see fs_set_cache
+#define DEFAULTIOTHREADS  4       // see fs_io_start
+#define DEFAULTCOPYTHREADS 4      // see copyRealFilesToMyDisk
+#define COPYBUFFERBLOCKS  64      // blocks moved at a time by copies between host and disk
+
+//Limits for block size, which must also be a power of two
+#define MINBLOCKSIZE  512
+#define MAXBLOCKSIZE  65536
+
+#define DIRHEADERSIZE ((offsetof(dirBlock_t, entries) + 7) & ~7)               // entries are 8-byte aligned
+#define DIRENTRYSIZE(nameLength) ((offsetof(dirEntry_t, name) + (nameLength) + 1 + 7) & ~7)
 #define MAXNAME       256
+#define DIRINDEXSLOTS      64   // directories whose name index is kept in memory
+#define DIRINDEXTHRESHOLD  8    // directories with fewer entries are searched linearly
+#define DIRLOCKSHARDS      16   // locks shared by directories, divides DIRINDEXSLOTS
+#define DENTRYCACHESIZE    256  // path components whose entry is kept in memory, power of two
 #define MAXPATHLENGTH 1024
 
 #define UNUSED        -1
@@ -31,6 +52,44 @@
 #define EOF           -1
 #endif
 
+#ifndef SEEK_SET
+#define SEEK_SET       0
+#define SEEK_CUR       1
+#define SEEK_END       2
+#endif
+
+//Error codes, see fs_last_error
+#define FS_OK                             0
+#define FS_ERR_NOT_FOUND                  1     // file, folder or path to it does not exist
+#define FS_ERR_EXISTS                     2
+#define FS_ERR_NOT_DIR                    3
+#define FS_ERR_IS_DIR                     4
+#define FS_ERR_NOT_EMPTY                  5
+#define FS_ERR_BUSY                       6     // folder is the current directory
+#define FS_ERR_BAD_PATH                   7     // empty or malformed path, or path above root
+#define FS_ERR_NAME_TOO_LONG              8
+#define FS_ERR_INVALID                    9     // invalid mode or geometry
+#define FS_ERR_NO_SPACE                   10
+#define FS_ERR_NO_MEMORY                  11
+#define FS_ERR_IO                         12    // file on the real disk cannot be used
+#define FS_ERR_CORRUPT                    13    // disk image has no valid superblock
+
+//Returned by calls which fail, the reason is given by fs_last_error
+#define FS_FAILED                         -1
+
+//What happens to freed blocks, see fs_set_zeroing
+#define FS_ZERO_NOW                       0     // zeroed as they are freed
+#define FS_ZERO_DEFERRED                  1     // zeroed by fs_scrub or writeDisk
+#define FS_ZERO_NEVER                     2
+
+//Levels of messages passed to the log callback, see fs_set_log
+#define FS_LOG_ERROR                      0
+#define FS_LOG_INFO                       1
+
+//Operations of block requests, see fs_io_submit
+#define FS_IO_READ                        0
+#define FS_IO_WRITE                       1
+
 //Constants for findEntryByName
 #define FILE_NOT_FOUND                    -1
 
@@ -41,6 +100,18 @@
 //Constants for allocateNewEntry
 #define ALLOCATION_FAILED                 -1
 
+//Constants for format
+#define FORMAT_FAILED                     -1
+
+//Constants for mapDisk
+#define MAPPING_FAILED                    -1
+
+//Constants for myfseek
+#define SEEK_FAILED                       -1
+
+//Constants for fs_get_stats
+#define STATS_DISABLED                    -1
+
 //Constants for findFreeBlock
 #define NO_FREE_BLOCKS                    -1
 
@@ -57,23 +128,86 @@
 
 typedef unsigned char Byte ;
 
-/* create a type fatEntry_t, we set this currently to short (16-bit)
+/* create a type fatEntry_t, a block index
+ * in memory it is always 32-bit, on disk FAT entries are 16 or 32-bit wide
+ * depending on fatWidth of the volume
+ */
+typedef int32_t fatEntry_t ;
+
+
+/* geometry of a volume, passed to format and recorded in the superblock
+ */
+
+typedef struct geometry {
+   int         blockCount ;
+   int         blockSize ;     // power of two, MINBLOCKSIZE to MAXBLOCKSIZE
+   int         fatWidth ;      // 16 or 32, 16-bit FAT allows at most 32768 blocks
+   int         journalBlocks ; // metadata journal following the FAT, 0 for none or at least 2
+} geometry_t ;
+
+
+/* the superblock is stored at the beginning of block 0
+ * the FAT follows in blocks 1 to fatBlockCount, then journalBlocks blocks
+ * of journal and the root directory
+ */
+
+#define SUPERBLOCKMAGIC 0x46415431
+
+typedef struct superBlock {
+   char        label [64] ;
+   uint32_t    magic ;
+   uint32_t    blockCount ;
+   uint32_t    blockSize ;
+   uint32_t    fatWidth ;
+   uint32_t    rootDirIndex ;
+   uint32_t    journalBlocks ; // 0 on volumes made before the journal
+   uint32_t    snapshotId ;    // set by writeDisk, names the image deltas apply to
+   uint32_t    freeBlocks ;    // free blocks and next free block search position, as of the FAT on disk
+   uint32_t    nextFreeHint ;
+} superBlock_t ;
+
+
+/* the journal begins with a header block, followed by images of the blocks
+ * of the last committed transaction; a header whose checksum does not match
+ * belongs to a transaction which was not committed
  */
-typedef short fatEntry_t ;
+
+#define JOURNALMAGIC 0x4a524e4c
+
+typedef struct journalHeader {
+   uint32_t    magic ;         // JOURNALMAGIC while a committed transaction is in the journal
+   uint32_t    blockCount ;    // blocks in the transaction
+   uint32_t    checksum ;      // of targets and images
+   uint32_t    targets [ MAXBLOCKSIZE / 4 - 3 ] ;   // home of each image
+} journalHeader_t ;
 
 
-// a FAT block is a list of 16-bit entries that form a chain of disk addresses
+/* a delta file made by writeDiskIncremental is a header followed by
+ * runCount runs, each a deltaRun_t followed by its blockCount blocks
+ */
+
+#define DELTAMAGIC 0x444c5441
 
-//const int   fatEntrycount = (blocksize / sizeof(fatEntry_t)) ;
+typedef struct deltaHeader {
+   uint32_t    magic ;
+   uint32_t    blockCount ;    // geometry of the volume
+   uint32_t    blockSize ;
+   uint32_t    snapshotId ;    // of the full image the delta builds on
+   uint32_t    sequence ;      // 1 for the first delta after the full image
+   uint32_t    runCount ;
+} deltaHeader_t ;
 
-typedef fatEntry_t fatBlock_t [ FATENTRYCOUNT ] ;
+typedef struct deltaRun {
+   uint32_t    first ;
+   uint32_t    blockCount ;
+} deltaRun_t ;
 
 
 /* create a type dirEntry_t
  */
  
 typedef struct dirEntry {
-   int         entryLength ;   // records length of this entry (can be used with names of variables length)
+   int         entryLength ;   // records length of this entry, name takes only as much of it as it needs
    Byte        isDir ;
    Byte        unUsed ;
    time_t      modTime ;
@@ -82,77 +216,228 @@ typedef struct dirEntry {
    char        name [MAXNAME] ;
 } dirEntry_t ;
 
-// a directory block is an array of directory entries
+// an entry on disk is addressed by directory block and offset within it
+
+typedef struct dirEntryRef {
+   fatEntry_t  blockIndex ;
+   int         offset ;
+} dirEntryRef_t ;
 
-//const int   dirEntrycount = (blocksize - (2*sizeof(int)) ) / sizeof(dirEntry_t) ;
+// a directory is a chain of directory blocks, each holding entries of variable
+// length packed from DIRHEADERSIZE up to nextEntry
 
 typedef struct dirBlock {
    int isDir ;
    fatEntry_t parentBlockIndex;
-   int nextEntry ;
-   dirEntry_t entryList [ DIRENTRYCOUNT ] ; // the first two integer are marker and endpos
+   int nextEntry ;                       // offset at which next entry of this block goes
+   Byte entries [ MAXBLOCKSIZE ] ;       // only blockSize - DIRHEADERSIZE bytes are in the block
 } dirBlock_t ;
 
 
 
 // a data block holds the actual data of a fileLength, it is an array of 8-bit (byte) elements
 
-typedef Byte dataBlock_t [ BLOCKSIZE ] ;
+typedef Byte dataBlock_t [ MAXBLOCKSIZE ] ;
 
 
-// a diskBlock can be either a directory block, a FAT block or actual data
+// a diskBlock can be either the superblock, a directory block, a FAT block or actual data
+// its real size is the block size of the volume, so it is only ever used through pointers
 
 typedef union block {
-   dataBlock_t data ;
-   dirBlock_t  dir  ;
-   fatBlock_t  fat  ;
+   dataBlock_t  data ;
+   superBlock_t super ;
+   journalHeader_t journal ;
+   dirBlock_t   dir  ;
+   int16_t      fat16 [ MAXBLOCKSIZE / 2 ] ;
+   int32_t      fat32 [ MAXBLOCKSIZE / 4 ] ;
 } diskBlock_t ;
 
-// finally, this is the disk: a list of diskBlocks
-// the disk is declared as extern, as it is shared in the program
-// it has to be defined in the main program fileLength
+// finally, this is the disk: blockCount blocks of blockSize bytes
+// each disk belongs to a file system context, which also holds its FAT,
+// allocator, caches, locks and current directory; contexts are independent
+// of each other, see fs_create
 
-extern diskBlock_t virtualDisk [ MAXBLOCKS ] ;
+typedef struct fs fs_t ;
 
 // when a file is opened on this disk, a file handle has to be
 // created in the opening program
 
 typedef struct filedescriptor {
+   fs_t      * fs;            // context the file was opened in
    int         pos;           // byte within a block
    char        mode;
    fatEntry_t  currBlockIndex;
-   diskBlock_t buffer;
-   fatEntry_t  lastBlockIndex;
+   int         currBlockNumber;   // position of currBlockIndex in the chain, 0 for first block
+   diskBlock_t * buffer;      // current block, borrowed in place from the disk
+   fatEntry_t  lastBlockIndex;    // last block of the file
    int         fileLength;
-   fatEntry_t  parentBlockIndex;
-   int         parentEntrylistIndex;
+   fatEntry_t  dirBlockIndex;     // first block of directory of the file
+   dirEntryRef_t entryRef;        // entry of the file in its directory
+   fatEntry_t  reservedNext;      // first block reserved by myfallocate, not yet in chain
+   int         reservedCount;     // number of reserved blocks left
+   fatEntry_t  spareNext;         // next block of the old chain of a file truncated by 'w'
+   int         spareCount;        // number of blocks left of it
+   fatEntry_t * chain;            // first chainLength blocks of the chain, filled in by myfseek
+   int         chainLength;
+   int         chainCapacity;
+   int         sequentialBlocks;  // blocks entered in chain order since open or last seek
+   int         readaheadEnd;      // position in chain up to which readahead was issued
+   pthread_mutex_t writeLock;     // held while bytes are written into buffer, see holdWriters
+   struct filedescriptor * nextWriter;   // writers of the context, see addWriter
+   struct filedescriptor * prevWriter;
 } MyFILE;
 
 
+// a directory opened for reading, see myopendir
+
+typedef struct dirhandle {
+   fs_t      * fs;             // context the directory was opened in
+   fatEntry_t  dirBlockIndex;  // first block of the directory
+   dirEntryRef_t next;         // entry myreaddir looks at next
+} MyDIR;
+
+
+// in-memory hash index of names in a directory, see findEntryByName
+
+typedef struct dirIndex {
+   int             dirBlockIndex;   // first block of directory this index belongs to, -1 if none
+   int             bucketCount;     // power of two
+   int             entryCount;      // taken buckets
+   dirEntryRef_t * buckets;         // entry of each bucket, blockIndex 0 for empty bucket
+   uint32_t      * hashes;          // hash of the name in each taken bucket
+} dirIndex_t;
+
+
+// in-memory cache of resolved path components, see lookupDentry
+
+typedef struct dentry {
+   fatEntry_t    dirBlockIndex;   // first block of directory holding the entry, -1 if slot is free
+   uint32_t      hash;            // hash of name
+   char          name[MAXNAME];
+   dirEntryRef_t entryRef;
+   fatEntry_t    firstBlock;
+   int           isDir;
+   int           hashNext;        // next slot in the same hash chain, -1 ends it
+   int           lruPrev;         // neighbours in order of use, most recent first
+   int           lruNext;
+} dentry_t;
+
+
+// receives messages of a context, see fs_set_log
+
+typedef void (* fs_log_t)(int level, const char * message, void * context);
+
+
+// a block read or write handed to the I/O engine of a context, see fs_io_submit
+// the request and its buffer belong to the caller until the request completes
+
+typedef struct fs_io_request fs_io_request_t;
+
+struct fs_io_request {
+   int         op;            // FS_IO_READ or FS_IO_WRITE
+   int         block;         // block of the volume
+   void      * buffer;        // a block of bytes read into or written from
+   void     (* done)(fs_io_request_t * request);   // called on an engine thread on completion, NULL to leave it to fs_io_poll
+   void      * context;       // for done
+   int         result;        // 0 or FS_ERR code, set on completion
+   fs_io_request_t * next;    // used by the engine
+};
+
+
+// operation counters of a context, see fs_get_stats
+// all fields are uint64_t, times are in nanoseconds
+
+typedef struct fs_stats {
+   uint64_t    blockViews;          // blocks borrowed in place for reading
+   uint64_t    blockEdits;          // blocks borrowed in place for writing
+   uint64_t    bytesRead;           // through handles
+   uint64_t    bytesWritten;
+   uint64_t    fatFlushes;          // calls of copyFAT
+   uint64_t    fatBlocksFlushed;
+   uint64_t    fatFlushTime;
+   uint64_t    freeBlockSearches;   // calls of findFreeBlock
+   uint64_t    freeBlockWordsScanned;   // words of the free bitmap looked at by them
+   uint64_t    freeRunSearches;     // calls of findFreeRun
+   uint64_t    freeRunBlocksScanned;
+   uint64_t    blocksFreed;
+   uint64_t    blocksZeroed;
+   uint64_t    journalCommits;      // transactions written through the journal
+   uint64_t    journalBlocksWritten;
+   uint64_t    groupsLoaded;        // groups of blocks loaded on first use from an image read by readDisk
+   uint64_t    ioRequests;          // block requests completed by the I/O engine
+   uint64_t    chainHops;           // FAT entries followed along chains
+   uint64_t    pathComponents;      // components looked up while resolving paths
+   uint64_t    dentryHits;
+   uint64_t    dentryMisses;
+   uint64_t    dirIndexHits;        // directory searches answered by a name index
+   uint64_t    dirScans;            // directory searches walking the entries
+   uint64_t    cacheEvictions;      // lines of a mapped image dropped by the block cache
+   uint64_t    cacheWriteBacks;     // blocks written back by it before dropping them
+} fs_stats_t;
+
+
 typedef struct directoryAndEntry {
    char folderName[MAXNAME];
    fatEntry_t folderFirstBlock;
    int pathToFolderFound;
    char entryName[MAXNAME];
    fatEntry_t entryFirstBlock;
+   dirEntryRef_t entryRef;        // entry in folder, set if found
    int entryFound;
 } folderAndEntry;
 
 
-void format();
-void writeDisk ( const char * filename );
-MyFILE * myfopen(const char * filename, const char mode);
+fs_t * fs_create();
+void fs_destroy(fs_t * fs);
+void fs_set_readahead(fs_t * fs, int blocks);
+int fs_set_cache(fs_t * fs, int blocks);
+void fs_set_log(fs_t * fs, fs_log_t log, void * context);
+void fs_set_zeroing(fs_t * fs, int mode);
+int fs_scrub(fs_t * fs, int maxBlocks);
+int fs_free_blocks(fs_t * fs);
+int fs_io_start(fs_t * fs, int threads);
+void fs_io_stop(fs_t * fs);
+int fs_io_submit(fs_t * fs, fs_io_request_t * const * requests, int count);
+int fs_io_poll(fs_t * fs, fs_io_request_t ** completed, int max, int wait);
+int fs_last_error();
+const char * fs_strerror(int error);
+int fs_get_stats(fs_t * fs, fs_stats_t * stats);
+void fs_reset_stats(fs_t * fs);
+void fs_dump_stats(fs_t * fs, FILE * out);
+int format(fs_t * fs, const geometry_t * geometry);
+int writeDisk ( fs_t * fs, const char * filename );
+int readDisk ( fs_t * fs, const char * filename );
+int writeDiskIncremental ( fs_t * fs, const char * filename );
+int readDiskDeltas ( fs_t * fs, const char * filename, const char * const * deltas, int count );
+int mapDisk ( fs_t * fs, const char * filename );
+int unmapDisk(fs_t * fs);
+MyFILE * myfopen(fs_t * fs, const char * filename, const char mode);
+int myfallocate(MyFILE * stream, int size);
+int myfseek(MyFILE * stream, long offset, int whence);
+long myftell(MyFILE * stream);
+int myftruncate(MyFILE * stream, long size);
 void myfclose(MyFILE * stream);
+int mysync(fs_t * fs);
 void myfputc(Byte b, MyFILE * stream);
 int myfgetc(MyFILE * stream);
-void mymkdir(char * path);
-char ** mylistdir(const char * path);
+size_t myfread(void * ptr, size_t size, MyFILE * stream);
+size_t myfreadbulk(void * ptr, size_t size, MyFILE * stream);
+size_t myfwrite(const void * ptr, size_t size, MyFILE * stream);
+int mymkdir(fs_t * fs, char * path);
+char ** mylistdir(fs_t * fs, const char * path);
 void freeList(char ** entries);
-void mychdir(char * path);
-void myremove(char * path);
-void myrmdir(char * path);
-
-void copyRealFileToMyDisk(char * realPath, char * path);
-void copyMyFileToRealDisk(char * realPath, char * path);
+MyDIR * myopendir(fs_t * fs, const char * path);
+const dirEntry_t * myreaddir(MyDIR * dir);
+void myclosedir(MyDIR * dir);
+int mychdir(fs_t * fs, char * path);
+int myremove(fs_t * fs, char * path);
+int myrmdir(fs_t * fs, char * path);
+
+int copyRealFileToMyDisk(fs_t * fs, char * realPath, char * path);
+int copyMyFileToRealDisk(fs_t * fs, char * realPath, char * path);
+int copyRealFilesToMyDisk(fs_t * fs, char * const * realPaths, char * const * paths, int count, int threads, int * results);
+int copyMyFilesToRealDisk(fs_t * fs, char * const * realPaths, char * const * paths, int count, int threads, int * results);
+int copyRealTreeToMyDisk(fs_t * fs, const char * realDir, const char * dir, int threads);
+int copyMyTreeToRealDisk(fs_t * fs, const char * realDir, const char * dir, int threads);
 
 #endif
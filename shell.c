@@ -2,25 +2,34 @@
 #include <string.h>
 #include "filesys.h"
 
+void printMessage(int level, const char * message, void * context)
+{
+    printf("\n%s", message);
+}
+
 int main()
 {   
+    fs_t * fs = fs_create();
+    fs_set_log(fs, printMessage, NULL);
+    
     printf("\n<>  FORMAT");
-    format();
+    format(fs, NULL);
 
     printf("\n<>  TESTING");
     
-    MyFILE * file = myfopen("file1.txt", 'w');
+    MyFILE * file = myfopen(fs, "file1.txt", 'w');
     for (int i = 0; i < 500; i++)
         myfputc(0x23, file);
     myfclose(file);
     
-    copyMyFileToRealDisk("file1.txt", "file1.txt");
-    copyRealFileToMyDisk("file1.txt", "file2.txt");
+    copyMyFileToRealDisk(fs, "file1.txt", "file1.txt");
+    copyRealFileToMyDisk(fs, "file1.txt", "file2.txt");
     
     
     printf("\n<>  SAVE TO FILE");
-    writeDisk("virtualdiskA5_A1");
+    writeDisk(fs, "virtualdiskA5_A1");
     
+    fs_destroy(fs);
     printf("\n<>  DONE \n");
     return 0;
 }
\ No newline at end of file
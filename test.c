@@ -0,0 +1,524 @@
+/* test.c
+ *
+ * tests of the filesystem API
+ *
+ * Every test works on volumes of its own and reports each check which
+ * fails with its line. Disk images and host files are made in the current
+ * directory and removed again.
+ *
+ * usage: test.exe
+ * returns: 0 if all checks passed, 1 otherwise
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "filesys.h"
+
+#define TESTIMAGE        "test_disk.img"
+#define TESTDELTA1       "test_disk.delta1"
+#define TESTDELTA2       "test_disk.delta2"
+#define HOSTDIR          "test_host"
+#define COPYDIR          "test_copy"
+#define LISTFILES        50
+#define CRASHED          42                     // exit status of a child which died at its crash point
+#define SYNCED           43                     // exit status of a child whose sync ran to its end
+
+int checks = 0;
+int failures = 0;
+
+#define CHECK(condition) check((condition), #condition, __LINE__)
+
+void check(int passed, const char * what, int line)
+{
+   checks++;
+   if (!passed) {
+      failures++;
+      printf("line %d: %s failed\n", line, what);
+   }
+}
+
+
+/* crash points
+ *
+ * The journal relies on the order in which writes to the image become
+ * durable, and fdatasync is where that order is fixed. This program defines
+ * fdatasync itself, so a child process can be made to die at any call of it,
+ * with everything written before the call in the image and nothing after.
+ */
+
+int crashAt = 0;       // call of fdatasync at which the process dies, 0 for none
+int syncCalls = 0;
+
+int fdatasync(int fd)
+{
+   if (++syncCalls == crashAt)
+      _exit(CRASHED);
+   return fsync(fd);
+}
+
+
+//Byte number i of the test file made from seed.
+Byte pattern(int seed, int i)
+{
+   return (Byte)(i * 31 + seed * 7 + (i >> 10));
+}
+
+//Write bytes first to first + length - 1 of the file made from seed to file.
+void writePattern(MyFILE * file, int seed, int first, int length)
+{
+   Byte chunk[1000];
+   for (int done = 0; done < length; ) {
+      int count = (length - done < (int)sizeof(chunk)) ? length - done : (int)sizeof(chunk);
+      for (int i = 0; i < count; i++)
+         chunk[i] = pattern(seed, first + done + i);
+      myfwrite(chunk, count, file);
+      done += count;
+   }
+}
+
+void writeFile(fs_t * fs, const char * path, int seed, int length)
+{
+   MyFILE * file = myfopen(fs, path, 'w');
+   CHECK(file != NULL);
+   if (file == NULL)
+      return;
+   writePattern(file, seed, 0, length);
+   myfclose(file);
+}
+
+//returns 1 if path holds length bytes of the file made from seed
+int fileMatches(fs_t * fs, const char * path, int seed, int length)
+{
+   MyFILE * file = myfopen(fs, path, 'r');
+   if (file == NULL)
+      return 0;
+   int matches = 1;
+   for (int i = 0; (i < length) && matches; i++)
+      matches = (myfgetc(file) == pattern(seed, i));
+   matches = matches && (myfgetc(file) == EOF);
+   myfclose(file);
+   return matches;
+}
+
+int fileExists(fs_t * fs, const char * path)
+{
+   MyFILE * file = myfopen(fs, path, 'r');
+   if (file != NULL)
+      myfclose(file);
+   return file != NULL;
+}
+
+int dirExists(fs_t * fs, const char * path)
+{
+   MyDIR * dir = myopendir(fs, path);
+   if (dir != NULL)
+      myclosedir(dir);
+   return dir != NULL;
+}
+
+//returns entry named name in directory path, which stays readable until the disk changes
+const dirEntry_t * findEntry(fs_t * fs, const char * path, const char * name)
+{
+   MyDIR * dir = myopendir(fs, path);
+   const dirEntry_t * entry = NULL;
+   while ((dir != NULL) && ((entry = myreaddir(dir)) != NULL) && (strcmp(entry->name, name) != 0))
+      ;
+   if (dir != NULL)
+      myclosedir(dir);
+   return entry;
+}
+
+
+/* a sync interrupted at each of its fdatasync calls leaves the volume as it
+   was before or as it is after the sync, never anything in between */
+
+geometry_t crashGeometry = { 2048, 1024, 16, 32 };
+
+//Volume before the sync: a file to remove, a file to append to and a directory.
+void makeStateBefore()
+{
+   unlink(TESTIMAGE);
+   fs_t * fs = fs_create();
+   CHECK(format(fs, &crashGeometry) == 0);
+   CHECK(writeDisk(fs, TESTIMAGE) == 0);
+   fs_destroy(fs);
+
+   fs = fs_create();
+   CHECK(mapDisk(fs, TESTIMAGE) == 0);
+   writeFile(fs, "/old", 1, 3000);
+   writeFile(fs, "/grow", 2, 1500);
+   CHECK(mymkdir(fs, "/d") == 0);
+   CHECK(mysync(fs) == 0);
+   fs_destroy(fs);
+}
+
+//Changes made by the sync: a new file, a longer file, a new directory, a file removed.
+void makeChanges(fs_t * fs)
+{
+   writeFile(fs, "/new", 3, 5000);
+   MyFILE * file = myfopen(fs, "/grow", 'a');
+   CHECK(file != NULL);
+   if (file != NULL) {
+      writePattern(file, 2, 1500, 2000);
+      myfclose(file);
+   }
+   CHECK(mymkdir(fs, "/d/sub") == 0);
+   CHECK(myremove(fs, "/old") == 0);
+}
+
+//Check the volume is wholly as before or wholly as after the sync.
+//returns 1 if it is as after
+int checkState(fs_t * fs, int freeBefore, int freeAfter)
+{
+   int after = fileExists(fs, "/new");
+   if (after) {
+      CHECK(fileMatches(fs, "/new", 3, 5000));
+      CHECK(fileMatches(fs, "/grow", 2, 3500));
+      CHECK(dirExists(fs, "/d/sub"));
+      CHECK(!fileExists(fs, "/old"));
+      CHECK(fs_free_blocks(fs) == freeAfter);
+   } else {
+      CHECK(fileMatches(fs, "/old", 1, 3000));
+      CHECK(fileMatches(fs, "/grow", 2, 1500));
+      CHECK(dirExists(fs, "/d"));
+      CHECK(!dirExists(fs, "/d/sub"));
+      CHECK(fs_free_blocks(fs) == freeBefore);
+   }
+   return after;
+}
+
+void testCrashReplay()
+{
+   //free blocks before and after the sync, from a run which is not interrupted
+   makeStateBefore();
+   fs_t * fs = fs_create();
+   CHECK(mapDisk(fs, TESTIMAGE) == 0);
+   int freeBefore = fs_free_blocks(fs);
+   makeChanges(fs);
+   CHECK(mysync(fs) == 0);
+   int freeAfter = fs_free_blocks(fs);
+   fs_destroy(fs);
+
+   int point;
+   for (point = 1; ; point++) {
+      makeStateBefore();
+      pid_t child = fork();
+      if (child == 0) {
+         fs = fs_create();
+         if (mapDisk(fs, TESTIMAGE) != 0)
+            _exit(1);
+         makeChanges(fs);
+         syncCalls = 0;
+         crashAt = point;
+         //no fs_destroy, which would sync again
+         _exit((mysync(fs) == 0) ? SYNCED : 1);
+      }
+
+      int status = 0;
+      CHECK((child > 0) && (waitpid(child, &status, 0) == child));
+      int crashed = WIFEXITED(status) && (WEXITSTATUS(status) == CRASHED);
+      CHECK(crashed || (WIFEXITED(status) && (WEXITSTATUS(status) == SYNCED)));
+
+      //readDisk replays the journal in memory, mapDisk in the image
+      fs = fs_create();
+      CHECK(readDisk(fs, TESTIMAGE) == 0);
+      int after = checkState(fs, freeBefore, freeAfter);
+      fs_destroy(fs);
+      fs = fs_create();
+      CHECK(mapDisk(fs, TESTIMAGE) == 0);
+      CHECK(checkState(fs, freeBefore, freeAfter) == after);
+      fs_destroy(fs);
+
+      if (!crashed) {
+         CHECK(after);
+         break;
+      }
+   }
+   //data, transaction, homes and cleared header are made durable in turn
+   CHECK(point > 3);
+   unlink(TESTIMAGE);
+}
+
+
+/* a volume read back from a full image and its deltas is the volume they were taken of */
+
+void testDeltas()
+{
+   geometry_t geometry = { 1024, 1024, 16, 0 };
+   fs_t * fs = fs_create();
+   CHECK(format(fs, &geometry) == 0);
+   writeFile(fs, "/a", 1, 4000);
+   CHECK(mymkdir(fs, "/d") == 0);
+   CHECK(writeDisk(fs, TESTIMAGE) == 0);
+
+   writeFile(fs, "/d/b", 2, 7000);
+   CHECK(myremove(fs, "/a") == 0);
+   CHECK(writeDiskIncremental(fs, TESTDELTA1) == 0);
+
+   MyFILE * file = myfopen(fs, "/d/b", 'a');
+   CHECK(file != NULL);
+   writePattern(file, 2, 7000, 3000);
+   myfclose(file);
+   writeFile(fs, "/c", 3, 100);
+   CHECK(writeDiskIncremental(fs, TESTDELTA2) == 0);
+   int freeBlocks = fs_free_blocks(fs);
+   fs_destroy(fs);
+
+   const char * deltas[] = { TESTDELTA1, TESTDELTA2 };
+   fs = fs_create();
+   CHECK(readDiskDeltas(fs, TESTIMAGE, deltas, 2) == 2);
+   CHECK(!fileExists(fs, "/a"));
+   CHECK(fileMatches(fs, "/d/b", 2, 10000));
+   CHECK(fileMatches(fs, "/c", 3, 100));
+   CHECK(fs_free_blocks(fs) == freeBlocks);
+   fs_destroy(fs);
+
+   //the first delta alone
+   fs = fs_create();
+   CHECK(readDiskDeltas(fs, TESTIMAGE, deltas, 1) == 1);
+   CHECK(!fileExists(fs, "/a"));
+   CHECK(fileMatches(fs, "/d/b", 2, 7000));
+   CHECK(!fileExists(fs, "/c"));
+   fs_destroy(fs);
+
+   //a delta out of order is not applied, the volume stays at the image
+   fs = fs_create();
+   CHECK(readDiskDeltas(fs, TESTIMAGE, deltas + 1, 1) == FS_FAILED);
+   CHECK(fileMatches(fs, "/a", 1, 4000));
+   CHECK(!fileExists(fs, "/d/b"));
+   fs_destroy(fs);
+
+   unlink(TESTIMAGE);
+   unlink(TESTDELTA1);
+   unlink(TESTDELTA2);
+}
+
+
+/* the I/O engine reads any block, but writes blocks of files only */
+
+//returns result of request op on block, carried out by the engine
+int engineRequest(fs_t * fs, int op, int block, Byte * buffer)
+{
+   fs_io_request_t request = { .op = op, .block = block, .buffer = buffer };
+   fs_io_request_t * list[1] = { &request };
+   fs_io_request_t * completed[1];
+   if ((fs_io_submit(fs, list, 1) != 0) || (fs_io_poll(fs, completed, 1, 1) != 1))
+      return FS_FAILED;
+   return request.result;
+}
+
+void testEngineWrites()
+{
+   geometry_t geometry = { 1024, 1024, 16, 0 };
+   fs_t * fs = fs_create();
+   CHECK(format(fs, &geometry) == 0);
+   writeFile(fs, "/f", 1, 3000);
+   CHECK(mymkdir(fs, "/d") == 0);
+   int fileBlock = findEntry(fs, "/", "f")->firstBlock;
+   int dirBlock = findEntry(fs, "/", "d")->firstBlock;
+   int freeBlock = geometry.blockCount - 1;
+   CHECK(fs_io_start(fs, 2) == 0);
+
+   Byte block[1024];
+   memset(block, 0x5a, sizeof(block));
+   CHECK(engineRequest(fs, FS_IO_WRITE, fileBlock, block) == 0);
+   MyFILE * file = myfopen(fs, "/f", 'r');
+   Byte read[1024];
+   CHECK(myfread(read, sizeof(read), file) == sizeof(read));
+   CHECK(memcmp(read, block, sizeof(block)) == 0);
+   myfclose(file);
+
+   //superblock, FAT, directories, free blocks and blocks past the end are not written
+   CHECK(engineRequest(fs, FS_IO_WRITE, 0, block) == FS_ERR_INVALID);
+   CHECK(engineRequest(fs, FS_IO_WRITE, 1, block) == FS_ERR_INVALID);
+   CHECK(engineRequest(fs, FS_IO_WRITE, dirBlock, block) == FS_ERR_INVALID);
+   CHECK(engineRequest(fs, FS_IO_WRITE, freeBlock, block) == FS_ERR_INVALID);
+   CHECK(engineRequest(fs, FS_IO_WRITE, geometry.blockCount, block) == FS_ERR_INVALID);
+   //but they can be read
+   CHECK(engineRequest(fs, FS_IO_READ, dirBlock, read) == 0);
+
+   //nor is the block a handle writes in place
+   file = myfopen(fs, "/g", 'w');
+   myfputc('x', file);
+   int writtenBlock = findEntry(fs, "/", "g")->firstBlock;
+   CHECK(engineRequest(fs, FS_IO_WRITE, writtenBlock, block) == FS_ERR_INVALID);
+   myfclose(file);
+   CHECK(engineRequest(fs, FS_IO_WRITE, writtenBlock, block) == 0);
+
+   fs_io_stop(fs);
+   fs_destroy(fs);
+}
+
+
+/* myftruncate gives tail blocks back and extends files with zeros */
+
+void testTruncate()
+{
+   fs_t * fs = fs_create();
+   CHECK(format(fs, NULL) == 0);
+   writeFile(fs, "/t", 1, 5000);
+   int freeBlocks = fs_free_blocks(fs);
+
+   MyFILE * file = myfopen(fs, "/t", 'a');
+   CHECK(myftruncate(file, 1200) == 0);
+   CHECK(myftell(file) == 1200);
+   myfclose(file);
+   CHECK(fileMatches(fs, "/t", 1, 1200));
+   CHECK(fs_free_blocks(fs) == freeBlocks + 3);
+
+   file = myfopen(fs, "/t", 'a');
+   CHECK(myftruncate(file, 4000) == 0);
+   myfclose(file);
+   file = myfopen(fs, "/t", 'r');
+   int matches = 1;
+   for (int i = 0; i < 4000; i++)
+      matches = matches && (myfgetc(file) == ((i < 1200) ? pattern(1, i) : 0));
+   CHECK(matches);
+   CHECK(myfgetc(file) == EOF);
+   CHECK(myftruncate(file, 0) == FS_FAILED);
+   myfclose(file);
+
+   fs_destroy(fs);
+}
+
+
+/* myreaddir returns every entry of a directory once */
+
+void testReadDir()
+{
+   fs_t * fs = fs_create();
+   CHECK(format(fs, NULL) == 0);
+   CHECK(mymkdir(fs, "/list") == 0);
+   CHECK(mymkdir(fs, "/list/sub") == 0);
+   char name[32];
+   for (int i = 0; i < LISTFILES; i++) {
+      sprintf(name, "/list/f%02d", i);
+      writeFile(fs, name, i, i);
+   }
+   for (int i = 0; i < LISTFILES; i += 5) {
+      sprintf(name, "/list/f%02d", i);
+      CHECK(myremove(fs, name) == 0);
+   }
+
+   int seen[LISTFILES] = { 0 };
+   int files = 0, dirs = 0, number;
+   MyDIR * dir = myopendir(fs, "/list");
+   CHECK(dir != NULL);
+   const dirEntry_t * entry;
+   while ((dir != NULL) && ((entry = myreaddir(dir)) != NULL)) {
+      if (entry->isDir) {
+         dirs++;
+         CHECK(strcmp(entry->name, "sub") == 0);
+      } else if ((sscanf(entry->name, "f%d", &number) == 1) && (number >= 0) && (number < LISTFILES)) {
+         files++;
+         seen[number]++;
+         CHECK(entry->fileLength == number);
+      } else {
+         CHECK(!"unexpected entry");
+      }
+   }
+   if (dir != NULL) {
+      CHECK(myreaddir(dir) == NULL);
+      myclosedir(dir);
+   }
+   CHECK(dirs == 1);
+   CHECK(files == LISTFILES - LISTFILES / 5);
+   for (int i = 0; i < LISTFILES; i++)
+      CHECK(seen[i] == ((i % 5 == 0) ? 0 : 1));
+
+   CHECK(myopendir(fs, "/list/f01") == NULL);
+   CHECK(myopendir(fs, "/none") == NULL);
+   fs_destroy(fs);
+}
+
+
+/* batch and tree copies between host and disk keep every byte */
+
+void writeHostFile(const char * path, int seed, int length)
+{
+   FILE * file = fopen(path, "wb");
+   CHECK(file != NULL);
+   for (int i = 0; (file != NULL) && (i < length); i++)
+      fputc(pattern(seed, i), file);
+   if (file != NULL)
+      fclose(file);
+}
+
+int hostFileMatches(const char * path, int seed, int length)
+{
+   FILE * file = fopen(path, "rb");
+   if (file == NULL)
+      return 0;
+   int matches = 1;
+   for (int i = 0; (i < length) && matches; i++)
+      matches = (fgetc(file) == pattern(seed, i));
+   matches = matches && (fgetc(file) == EOF);
+   fclose(file);
+   return matches;
+}
+
+void testCopies()
+{
+   mkdir(HOSTDIR, 0755);
+   mkdir(HOSTDIR "/sub", 0755);
+   writeHostFile(HOSTDIR "/a.bin", 1, 5000);
+   writeHostFile(HOSTDIR "/sub/b.bin", 2, 70000);
+   writeHostFile(HOSTDIR "/sub/empty.bin", 3, 0);
+
+   fs_t * fs = fs_create();
+   CHECK(format(fs, NULL) == 0);
+   CHECK(copyRealTreeToMyDisk(fs, HOSTDIR, "/in", 2) == 0);
+   CHECK(fileMatches(fs, "/in/a.bin", 1, 5000));
+   CHECK(fileMatches(fs, "/in/sub/b.bin", 2, 70000));
+   CHECK(fileMatches(fs, "/in/sub/empty.bin", 3, 0));
+
+   CHECK(copyMyTreeToRealDisk(fs, COPYDIR, "/in", 2) == 0);
+   CHECK(hostFileMatches(COPYDIR "/a.bin", 1, 5000));
+   CHECK(hostFileMatches(COPYDIR "/sub/b.bin", 2, 70000));
+   CHECK(hostFileMatches(COPYDIR "/sub/empty.bin", 3, 0));
+
+   //a batch reports the result of every pair
+   char * realPaths[] = { HOSTDIR "/a.bin", HOSTDIR "/sub/b.bin", HOSTDIR "/missing" };
+   char * paths[] = { "/x1", "/x2", "/x3" };
+   int results[3];
+   CHECK(copyRealFilesToMyDisk(fs, realPaths, paths, 3, 2, results) == FS_FAILED);
+   CHECK((results[0] == FS_OK) && (results[1] == FS_OK) && (results[2] != FS_OK));
+   CHECK(fileMatches(fs, "/x1", 1, 5000));
+   CHECK(fileMatches(fs, "/x2", 2, 70000));
+
+   char * copies[] = { COPYDIR "/x1", COPYDIR "/x2" };
+   CHECK(copyMyFilesToRealDisk(fs, copies, paths, 2, 2, results) == 0);
+   CHECK(hostFileMatches(COPYDIR "/x1", 1, 5000));
+   CHECK(hostFileMatches(COPYDIR "/x2", 2, 70000));
+   fs_destroy(fs);
+
+   const char * made[] = { HOSTDIR "/a.bin", HOSTDIR "/sub/b.bin", HOSTDIR "/sub/empty.bin",
+                           COPYDIR "/a.bin", COPYDIR "/sub/b.bin", COPYDIR "/sub/empty.bin",
+                           COPYDIR "/x1", COPYDIR "/x2" };
+   for (size_t i = 0; i < sizeof(made) / sizeof(made[0]); i++)
+      unlink(made[i]);
+   rmdir(HOSTDIR "/sub");
+   rmdir(HOSTDIR);
+   rmdir(COPYDIR "/sub");
+   rmdir(COPYDIR);
+}
+
+
+int main()
+{
+   testCrashReplay();
+   testDeltas();
+   testEngineWrites();
+   testTruncate();
+   testReadDir();
+   testCopies();
+
+   printf("%d checks, %d failed\n", checks, failures);
+   return (failures == 0) ? 0 : 1;
+}
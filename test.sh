@@ -0,0 +1,3 @@
+rm test.exe
+gcc -std=c99 -g test.c filesys.c -o test.exe -pthread
+./test.exe